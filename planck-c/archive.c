@@ -32,7 +32,27 @@ void close_archive(void* archive) {
     zip_close(archive);
 }
 
+int64_t archive_num_entries(void *archive) {
+    return zip_get_num_entries(archive, 0);
+}
+
+const char *archive_entry_name(void *archive, int64_t index) {
+    return zip_get_name(archive, (zip_uint64_t) index, 0);
+}
+
 contents_zip_t get_contents_zip(void* archive_p, const char *name, time_t *last_modified, char **error_msg) {
+    zip_int64_t index = zip_name_locate(archive_p, name, 0);
+    if (index < 0) {
+        contents_zip_t rv;
+        rv.payload = NULL;
+        rv.length = 0;
+        return rv;
+    }
+
+    return get_contents_zip_index(archive_p, index, last_modified, error_msg);
+}
+
+contents_zip_t get_contents_zip_index(void* archive_p, int64_t index, time_t *last_modified, char **error_msg) {
     contents_zip_t rv;
     rv.payload = NULL;
     rv.length = 0;
@@ -40,11 +60,11 @@ contents_zip_t get_contents_zip(void* archive_p, const char *name, time_t *last_
     zip_t *archive = archive_p;
     
     zip_stat_t stat;
-    if (zip_stat(archive, name, 0, &stat) < 0) {
+    if (zip_stat_index(archive, (zip_uint64_t) index, 0, &stat) < 0) {
         return rv;
     }
 
-    zip_file_t *f = zip_fopen(archive, name, 0);
+    zip_file_t *f = zip_fopen_index(archive, (zip_uint64_t) index, 0);
     if (f == NULL) {
         if (error_msg) {
             format_zip_error("zip_fopen", archive, error_msg);
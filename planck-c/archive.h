@@ -7,4 +7,7 @@ typedef struct contents_zip {
 
 void* open_archive(const char *path, char **error_msg);
 void close_archive(void* archive);
+int64_t archive_num_entries(void *archive);
+const char *archive_entry_name(void *archive, int64_t index);
 contents_zip_t get_contents_zip(void* archive, const char *name, time_t *last_modified, char **error_msg);
+contents_zip_t get_contents_zip_index(void* archive, int64_t index, time_t *last_modified, char **error_msg);
@@ -1,5 +1,6 @@
 #include <stdio.h>
 
+#include "bundle.h"
 #include "bundle_inflate.h"
 
 char *bundle_get_contents(char *path) {
@@ -7,7 +8,15 @@ char *bundle_get_contents(char *path) {
     return NULL;
 }
 
-#ifdef BUNDLE_TEST
+const char *bundle_get_view(const char *path, size_t *len) {
+    return NULL;
+}
+
+bool bundle_exists(const char *path) {
+    return false;
+}
+
+#if defined(BUNDLE_TEST) || defined(BUNDLE_BENCH)
 int main(void) {
     fprintf(stderr, "no bundled sources, need to run run script/bundle-c\n");
     return -1;
@@ -1 +1,10 @@
-char *bundle_get_contents(char *path);
\ No newline at end of file
+#include <stdbool.h>
+#include <stddef.h>
+
+char *bundle_get_contents(char *path);
+
+// Returns the bundled contents for path in place, or NULL if the bundle is
+// compressed (in which case bundle_get_contents must be used).
+const char *bundle_get_view(const char *path, size_t *len);
+
+bool bundle_exists(const char *path);
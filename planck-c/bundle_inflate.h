@@ -4,7 +4,7 @@
 
 #include <zlib.h>
 
-int bundle_inflate(char *dest, unsigned char *src, unsigned int src_len, unsigned int len) {
+int bundle_inflate(char *dest, const unsigned char *src, unsigned int src_len, unsigned int len) {
     if (src_len == 0) {
         return 0;
     }
@@ -13,7 +13,7 @@ int bundle_inflate(char *dest, unsigned char *src, unsigned int src_len, unsigne
     int status;
 
     z_stream strm;
-    strm.next_in = src;
+    strm.next_in = (unsigned char *) src;
     strm.avail_in = src_len;
     strm.total_out = 0;
     strm.zalloc = Z_NULL;
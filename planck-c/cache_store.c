@@ -0,0 +1,394 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache_store.h"
+#include "strmap.h"
+
+// The pack file starts with PACK_HEADER, followed by records of the form
+//
+//   magic key-length data-length key \0 data \0
+//
+// with the three leading fields as 32-bit integers. A later record for a key
+// replaces earlier ones, and a record with a data length of TOMBSTONE (and no
+// data) removes the key.
+//
+// Writers append whole records with a single write while holding an
+// exclusive flock on the pack, and readers hold a shared flock while indexing
+// records appended since they last looked, so readers never index a partially
+// written record. When mostly dead, the pack is compacted by writing the live
+// records to a new file that is renamed over the pack; processes notice this
+// by the change of inode and reopen it.
+
+#define PACK_NAME "cache.pack"
+#define PACK_HEADER "PLANCK-CACHE-PACK 1\n"
+#define RECORD_MAGIC 0x504b5231
+#define TOMBSTONE UINT32_MAX
+
+#define COMPACT_MIN_DEAD_BYTES (4 * 1024 * 1024)
+
+struct record_header {
+    uint32_t magic;
+    uint32_t key_len;
+    uint32_t data_len;
+};
+
+struct cache_store {
+    char *dir;
+    char *path;
+    int fd;
+    bool writable;
+    dev_t dev;
+    ino_t ino;
+    char *map;
+    size_t map_len;
+    size_t indexed_upto;
+    size_t dead_bytes;
+    strmap_t *index;
+};
+
+static struct cache_store *store = NULL;
+
+static size_t record_size(struct record_header *header) {
+    return sizeof(struct record_header) + header->key_len + 1 +
+           (header->data_len == TOMBSTONE ? 0 : header->data_len + 1);
+}
+
+static void free_key(const char *key, void *value, void *data) {
+    free((char *) key);
+}
+
+static void reset_store() {
+    if (store->map != NULL) {
+        munmap(store->map, store->map_len);
+    }
+    if (store->fd >= 0) {
+        close(store->fd);
+    }
+    if (store->index != NULL) {
+        strmap_each(store->index, free_key, NULL);
+        strmap_free(store->index);
+    }
+    store->fd = -1;
+    store->map = NULL;
+    store->map_len = 0;
+    store->indexed_upto = 0;
+    store->dead_bytes = 0;
+    store->index = NULL;
+}
+
+static int open_pack(bool create) {
+    int flags = create ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY;
+    int fd = open(store->path, flags | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    store->fd = fd;
+    store->writable = create;
+    store->dev = st.st_dev;
+    store->ino = st.st_ino;
+    store->index = strmap_create(1024);
+    return 0;
+}
+
+static struct cache_store *get_store(const char *dir) {
+    if (store != NULL && strcmp(store->dir, dir) != 0) {
+        reset_store();
+        free(store->dir);
+        free(store->path);
+        free(store);
+        store = NULL;
+    }
+
+    if (store == NULL) {
+        store = calloc(1, sizeof(struct cache_store));
+        store->dir = strdup(dir);
+        store->path = malloc(strlen(dir) + strlen(PACK_NAME) + 2);
+        sprintf(store->path, "%s/%s", dir, PACK_NAME);
+        store->fd = -1;
+    }
+
+    return store;
+}
+
+// Maps the pack up to size and indexes the records beyond those already
+// indexed, stopping at the first incomplete or corrupt record
+static int index_records(size_t size) {
+    if (size > store->map_len) {
+        char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, store->fd, 0);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        if (store->map != NULL) {
+            munmap(store->map, store->map_len);
+        }
+        store->map = map;
+        store->map_len = size;
+    }
+
+    size_t header_len = strlen(PACK_HEADER);
+    if (store->indexed_upto == 0) {
+        if (size < header_len || memcmp(store->map, PACK_HEADER, header_len) != 0) {
+            return 0;
+        }
+        store->indexed_upto = header_len;
+    }
+
+    while (store->indexed_upto + sizeof(struct record_header) <= size) {
+        struct record_header header;
+        memcpy(&header, store->map + store->indexed_upto, sizeof(struct record_header));
+        if (header.magic != RECORD_MAGIC || store->indexed_upto + record_size(&header) > size) {
+            break;
+        }
+
+        const char *key = store->map + store->indexed_upto + sizeof(struct record_header);
+        size_t previous = (size_t) strmap_get(store->index, key);
+        if (previous != 0) {
+            struct record_header previous_header;
+            memcpy(&previous_header, store->map + previous, sizeof(struct record_header));
+            if (previous_header.data_len != TOMBSTONE) {
+                store->dead_bytes += record_size(&previous_header);
+            }
+            strmap_put(store->index, key, (void *) store->indexed_upto);
+        } else {
+            strmap_put(store->index, strdup(key), (void *) store->indexed_upto);
+        }
+        if (header.data_len == TOMBSTONE) {
+            store->dead_bytes += record_size(&header);
+        }
+
+        store->indexed_upto += record_size(&header);
+    }
+
+    return 0;
+}
+
+// Brings the index up to date with the pack on disk. The caller may already
+// hold the exclusive lock when writing.
+static int refresh(bool create, bool locked) {
+    struct stat st;
+    if (stat(store->path, &st) < 0) {
+        int saved_errno = errno;
+        reset_store();
+        if (saved_errno != ENOENT || !create) {
+            errno = saved_errno;
+            return -1;
+        }
+    } else if (store->fd >= 0 && (st.st_dev != store->dev || st.st_ino != store->ino)) {
+        // Replaced by compaction
+        reset_store();
+    }
+
+    if (store->fd < 0 && open_pack(create) < 0) {
+        return -1;
+    }
+
+    if (fstat(store->fd, &st) < 0) {
+        return -1;
+    }
+
+    size_t size = (size_t) st.st_size;
+    if (size <= store->indexed_upto) {
+        return 0;
+    }
+
+    if (!locked && flock(store->fd, LOCK_SH) < 0) {
+        return -1;
+    }
+    if (!locked && fstat(store->fd, &st) == 0) {
+        size = (size_t) st.st_size;
+    }
+    int rv = index_records(size);
+    if (!locked) {
+        flock(store->fd, LOCK_UN);
+    }
+    return rv;
+}
+
+const char *cache_store_get(const char *dir, const char *key, size_t *len) {
+    if (dir == NULL) {
+        return NULL;
+    }
+
+    get_store(dir);
+    if (refresh(false, false) < 0) {
+        return NULL;
+    }
+
+    size_t offset = (size_t) strmap_get(store->index, key);
+    if (offset == 0) {
+        return NULL;
+    }
+
+    struct record_header header;
+    memcpy(&header, store->map + offset, sizeof(struct record_header));
+    if (header.data_len == TOMBSTONE) {
+        return NULL;
+    }
+
+    if (len) {
+        *len = header.data_len;
+    }
+    return store->map + offset + sizeof(struct record_header) + header.key_len + 1;
+}
+
+static int write_fully(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static size_t append_record(char *buf, const char *key, const char *data) {
+    struct record_header header;
+    header.magic = RECORD_MAGIC;
+    header.key_len = (uint32_t) strlen(key);
+    header.data_len = data != NULL ? (uint32_t) strlen(data) : TOMBSTONE;
+
+    size_t n = 0;
+    memcpy(buf + n, &header, sizeof(struct record_header));
+    n += sizeof(struct record_header);
+    memcpy(buf + n, key, header.key_len + 1);
+    n += header.key_len + 1;
+    if (data != NULL) {
+        memcpy(buf + n, data, header.data_len + 1);
+        n += header.data_len + 1;
+    }
+    return n;
+}
+
+struct compaction {
+    char *buf;
+    size_t len;
+};
+
+static void copy_live_record(const char *key, void *value, void *data) {
+    struct compaction *compaction = data;
+    struct record_header header;
+    memcpy(&header, store->map + (size_t) value, sizeof(struct record_header));
+    if (header.data_len != TOMBSTONE) {
+        size_t size = record_size(&header);
+        memcpy(compaction->buf + compaction->len, store->map + (size_t) value, size);
+        compaction->len += size;
+    }
+}
+
+// Rewrites the live records to a new pack, called with the exclusive lock held
+static void compact() {
+    size_t header_len = strlen(PACK_HEADER);
+    struct compaction compaction;
+    compaction.buf = malloc(store->indexed_upto - store->dead_bytes);
+    memcpy(compaction.buf, PACK_HEADER, header_len);
+    compaction.len = header_len;
+    strmap_each(store->index, copy_live_record, &compaction);
+
+    char *tmp_path = malloc(strlen(store->path) + 32);
+    sprintf(tmp_path, "%s.%ld.tmp", store->path, (long) getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        bool failed = write_fully(fd, compaction.buf, compaction.len) < 0;
+        failed = close(fd) < 0 || failed;
+        if (failed || rename(tmp_path, store->path) < 0) {
+            unlink(tmp_path);
+        }
+    }
+
+    free(tmp_path);
+    free(compaction.buf);
+}
+
+int cache_store_put(const char *dir, size_t count, const char *keys[], const char *data[]) {
+    get_store(dir);
+    if (store->fd >= 0 && !store->writable) {
+        reset_store();
+    }
+
+    // Lock the pack, making sure it wasn't replaced while waiting for the lock
+    for (;;) {
+        if (refresh(true, false) < 0) {
+            return -1;
+        }
+        if (flock(store->fd, LOCK_EX) < 0) {
+            return -1;
+        }
+        struct stat st;
+        if (stat(store->path, &st) == 0 && st.st_dev == store->dev && st.st_ino == store->ino) {
+            break;
+        }
+        flock(store->fd, LOCK_UN);
+        reset_store();
+    }
+
+    int rv = -1;
+    if (refresh(true, true) < 0) {
+        goto unlock;
+    }
+
+    // Drop anything left by a writer that failed part way through a record
+    struct stat st;
+    if (fstat(store->fd, &st) < 0) {
+        goto unlock;
+    }
+    size_t header_len = strlen(PACK_HEADER);
+    if (store->indexed_upto < (size_t) st.st_size && ftruncate(store->fd, store->indexed_upto) < 0) {
+        goto unlock;
+    }
+
+    size_t len = store->indexed_upto == 0 ? header_len : 0;
+    size_t i;
+    for (i = 0; i < count; i++) {
+        len += sizeof(struct record_header) + strlen(keys[i]) + 1 + (data[i] != NULL ? strlen(data[i]) + 1 : 0);
+    }
+
+    char *buf = malloc(len);
+    size_t n = 0;
+    if (store->indexed_upto == 0) {
+        memcpy(buf, PACK_HEADER, header_len);
+        n = header_len;
+    }
+    for (i = 0; i < count; i++) {
+        n += append_record(buf + n, keys[i], data[i]);
+    }
+
+    int write_rv = write_fully(store->fd, buf, n);
+    free(buf);
+    if (write_rv < 0 || index_records(store->indexed_upto + n) < 0) {
+        goto unlock;
+    }
+
+    if (store->dead_bytes > COMPACT_MIN_DEAD_BYTES && 2 * store->dead_bytes > store->indexed_upto) {
+        compact();
+    }
+    rv = 0;
+
+unlock:
+    if (store->fd >= 0) {
+        int saved_errno = errno;
+        flock(store->fd, LOCK_UN);
+        errno = saved_errno;
+    }
+    return rv;
+}
@@ -0,0 +1,12 @@
+#include <stddef.h>
+
+// A packed compilation cache: a single append-only file of keyed records in
+// the cache directory, memory-mapped and indexed by key.
+
+// Returns the data stored for key, or NULL if there is none. The returned
+// pointer is into the mapped file and is valid until the next call.
+const char *cache_store_get(const char *dir, const char *key, size_t *len);
+
+// Appends records for count keys in a single write. A NULL data entry
+// removes the key. Returns 0 on success, or -1 with errno set.
+int cache_store_put(const char *dir, size_t count, const char *keys[], const char *data[]);
@@ -0,0 +1,306 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "classpath.h"
+#include "engine.h"
+#include "globals.h"
+#include "io.h"
+#include "strmap.h"
+
+// The index is saved in the cache directory (if there is one), keyed by a
+// hash of the path, size and modification time of each JAR, so that a later
+// launch with the same JARs can load it without opening any of them. It is
+// saved as a header line followed by lines of the form
+//
+//   <entry name> TAB <src path index> TAB <entry index>
+
+#define INDEX_NAME "classpath.index"
+#define INDEX_HEADER "PLANCK-CLASSPATH-INDEX 1"
+
+struct jar_entry {
+    int src_path;
+    int64_t entry_index;
+};
+
+struct jar_state {
+    time_t mtime;
+    off_t size;
+};
+
+// Keys are entry names owned by the open archives, or by index_buffer when
+// the index was loaded from the cache
+static strmap_t *jar_index = NULL;
+static struct jar_entry *jar_entries = NULL;
+static size_t num_jar_entries = 0;
+static char *index_buffer = NULL;
+static struct jar_state *jar_states = NULL;
+static time_t last_validated = 0;
+
+static bool is_jar(size_t i) {
+    return !config.src_paths[i].blacklisted && strcmp(config.src_paths[i].type, "jar") == 0;
+}
+
+static void open_jar(size_t i) {
+    if (!config.src_paths[i].archive) {
+        char *error_msg = NULL;
+        config.src_paths[i].archive = open_archive(config.src_paths[i].path, &error_msg);
+        if (error_msg) {
+            engine_print(error_msg);
+            engine_print("\n");
+            free(error_msg);
+        }
+    }
+}
+
+// Records the current state of the JARs, returning a hash of it
+static uint64_t stat_jars() {
+    if (jar_states == NULL) {
+        jar_states = calloc(config.num_src_paths, sizeof(struct jar_state));
+    }
+
+    size_t len = 0;
+    char *description = NULL;
+    size_t i;
+    for (i = 0; i < config.num_src_paths; i++) {
+        if (!is_jar(i)) {
+            continue;
+        }
+        char *location = config.src_paths[i].path;
+        struct stat file_stat;
+        if (stat(location, &file_stat) != 0) {
+            engine_perror(location);
+            config.src_paths[i].blacklisted = true;
+            continue;
+        }
+        jar_states[i].mtime = file_stat.st_mtime;
+        jar_states[i].size = file_stat.st_size;
+
+        description = realloc(description, len + strlen(location) + 64);
+        len += sprintf(description + len, "%zu\t%s\t%lld\t%lld\n", i, location,
+                       (long long) file_stat.st_size, (long long) file_stat.st_mtime);
+    }
+
+    uint64_t key = strmap_hash(description ? description : "");
+    free(description);
+    return key;
+}
+
+static void reset_index() {
+    strmap_free(jar_index);
+    jar_index = NULL;
+    free(jar_entries);
+    jar_entries = NULL;
+    num_jar_entries = 0;
+    free(index_buffer);
+    index_buffer = NULL;
+}
+
+static void add_entry(const char *name, size_t src_path, int64_t entry_index) {
+    if (!strmap_contains(jar_index, name)) {
+        jar_entries[num_jar_entries].src_path = (int) src_path;
+        jar_entries[num_jar_entries].entry_index = entry_index;
+        strmap_put(jar_index, name, &jar_entries[num_jar_entries]);
+        num_jar_entries++;
+    }
+}
+
+static void build_index() {
+    size_t capacity = 0;
+    size_t i;
+    for (i = 0; i < config.num_src_paths; i++) {
+        if (is_jar(i)) {
+            open_jar(i);
+            if (config.src_paths[i].archive) {
+                int64_t n = archive_num_entries(config.src_paths[i].archive);
+                capacity += n > 0 ? (size_t) n : 0;
+            }
+        }
+    }
+
+    jar_index = strmap_create(capacity);
+    jar_entries = malloc(capacity * sizeof(struct jar_entry));
+
+    for (i = 0; i < config.num_src_paths; i++) {
+        void *archive = config.src_paths[i].archive;
+        if (!is_jar(i) || !archive) {
+            continue;
+        }
+        int64_t n = archive_num_entries(archive);
+        int64_t j;
+        for (j = 0; j < n; j++) {
+            const char *name = archive_entry_name(archive, j);
+            if (name != NULL) {
+                add_entry(name, i, j);
+            }
+        }
+    }
+}
+
+static char *index_path() {
+    char *path = malloc(strlen(config.cache_path) + strlen(INDEX_NAME) + 2);
+    sprintf(path, "%s/%s", config.cache_path, INDEX_NAME);
+    return path;
+}
+
+static bool load_index(uint64_t key) {
+    if (config.cache_path == NULL) {
+        return false;
+    }
+
+    char *path = index_path();
+    char *buffer = get_contents(path, NULL);
+    free(path);
+    if (buffer == NULL) {
+        return false;
+    }
+
+    char expected[64];
+    snprintf(expected, sizeof(expected), "%s %016llx\n", INDEX_HEADER, (unsigned long long) key);
+    if (strncmp(buffer, expected, strlen(expected)) != 0) {
+        free(buffer);
+        return false;
+    }
+
+    char *lines = buffer + strlen(expected);
+    size_t capacity = 0;
+    char *p;
+    for (p = lines; *p; p++) {
+        if (*p == '\n') {
+            capacity++;
+        }
+    }
+
+    jar_index = strmap_create(capacity);
+    jar_entries = malloc(capacity * sizeof(struct jar_entry));
+    index_buffer = buffer;
+
+    char *line = lines;
+    char *end;
+    while ((end = strchr(line, '\n')) != NULL) {
+        *end = '\0';
+        char *src_path = strchr(line, '\t');
+        char *entry_index = src_path ? strchr(src_path + 1, '\t') : NULL;
+        if (entry_index == NULL) {
+            reset_index();
+            return false;
+        }
+        *src_path++ = '\0';
+        *entry_index++ = '\0';
+
+        size_t i = (size_t) strtoul(src_path, NULL, 10);
+        if (i >= config.num_src_paths || !is_jar(i)) {
+            reset_index();
+            return false;
+        }
+        add_entry(line, i, strtoll(entry_index, NULL, 10));
+        line = end + 1;
+    }
+
+    return true;
+}
+
+static void save_index(uint64_t key) {
+    if (config.cache_path == NULL) {
+        return;
+    }
+
+    char *path = index_path();
+    char *tmp_path = malloc(strlen(path) + 32);
+    sprintf(tmp_path, "%s.%ld.tmp", path, (long) getpid());
+
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        free(tmp_path);
+        free(path);
+        return;
+    }
+
+    bool failed = false;
+    fprintf(f, "%s %016llx\n", INDEX_HEADER, (unsigned long long) key);
+    size_t i;
+    for (i = 0; i < num_jar_entries && !failed; i++) {
+        const char *name = config.src_paths[jar_entries[i].src_path].archive
+                           ? archive_entry_name(config.src_paths[jar_entries[i].src_path].archive,
+                                                jar_entries[i].entry_index)
+                           : NULL;
+        // Names that can't be represented in the index prevent saving it
+        failed = name == NULL || strpbrk(name, "\t\n") != NULL;
+        if (!failed) {
+            fprintf(f, "%s\t%d\t%lld\n", name, jar_entries[i].src_path,
+                    (long long) jar_entries[i].entry_index);
+        }
+    }
+
+    failed = ferror(f) != 0 || failed;
+    if (fclose(f) != 0 || failed || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    free(path);
+}
+
+static void ensure_index() {
+    uint64_t key = stat_jars();
+    if (!load_index(key)) {
+        build_index();
+        save_index(key);
+    }
+}
+
+// Closes the archives of any JARs that have changed on disk, returning
+// whether there were any
+static bool close_changed_jars() {
+    bool changed = false;
+    size_t i;
+    for (i = 0; i < config.num_src_paths; i++) {
+        if (!is_jar(i)) {
+            continue;
+        }
+        struct stat file_stat;
+        if (stat(config.src_paths[i].path, &file_stat) != 0 ||
+            file_stat.st_mtime != jar_states[i].mtime ||
+            file_stat.st_size != jar_states[i].size) {
+            if (config.src_paths[i].archive) {
+                close_archive(config.src_paths[i].archive);
+                config.src_paths[i].archive = NULL;
+            }
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+int classpath_find_jar(const char *path, int64_t *entry_index) {
+    time_t now = time(NULL);
+    if (jar_index == NULL) {
+        ensure_index();
+        last_validated = now;
+    } else if (now != last_validated) {
+        last_validated = now;
+        if (close_changed_jars()) {
+            reset_index();
+            ensure_index();
+        }
+    }
+
+    struct jar_entry *entry = strmap_get(jar_index, path);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    // With an index loaded from the cache, JARs are only opened when needed
+    open_jar((size_t) entry->src_path);
+    if (!config.src_paths[entry->src_path].archive) {
+        return -1;
+    }
+
+    *entry_index = entry->entry_index;
+    return entry->src_path;
+}
@@ -0,0 +1,10 @@
+#include <stdint.h>
+
+// An index of the entries in the JARs on the classpath, built on first use,
+// mapping each path to the first JAR in classpath order that contains it.
+// The JARs are checked for changes at most once a second, and the index is
+// rebuilt if any has changed.
+
+// Returns the index in config.src_paths of the first JAR containing path,
+// setting *entry_index to its index within the JAR, or -1 if no JAR does.
+int classpath_find_jar(const char *path, int64_t *entry_index);
@@ -2,6 +2,7 @@
 #include "engine.h"
 #include <time.h>
 #include <stdio.h>
+#include <sys/resource.h>
 
 #if __DARWIN_UNIX03
 
@@ -34,6 +35,19 @@ void init_launch_timing() {
     last_display = launch_time;
 }
 
+// Peak resident set size in kilobytes
+static long max_rss_kb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#if __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
 void display_launch_timing(const char *label) {
     if (launch_time) {
         uint64_t now = system_time();
@@ -41,7 +55,8 @@ void display_launch_timing(const char *label) {
         uint64_t elapsed = now - last_display;
         last_display = now;
         char buffer[1024];
-        snprintf(buffer, 1024, "%50s: %10.6f %10.6f\n", label, 1e-6 * elapsed, 1e-6 * total_elapsed);
+        snprintf(buffer, 1024, "%50s: %10.6f %10.6f %8ld KB\n", label, 1e-6 * elapsed, 1e-6 * total_elapsed,
+                 max_rss_kb());
         engine_print(buffer);
     }
 }
@@ -18,6 +18,8 @@
 #include "str.h"
 #include "engine.h"
 #include "clock.h"
+#include "snapshot.h"
+#include "prefetch.h"
 
 JSGlobalContextRef ctx = NULL;
 
@@ -175,7 +177,7 @@ JSValueRef get_value(JSContextRef ctx, char *namespace, char *name) {
     return val;
 }
 
-JSObjectRef get_function(char *namespace, char *name) {
+JSObjectRef get_context_function(JSContextRef ctx, char *namespace, char *name) {
     JSValueRef val = get_value(ctx, namespace, name);
     if (JSValueIsUndefined(ctx, val)) {
         char buffer[1024];
@@ -186,6 +188,10 @@ JSObjectRef get_function(char *namespace, char *name) {
     return JSValueToObject(ctx, val, NULL);
 }
 
+JSObjectRef get_function(char *namespace, char *name) {
+    return get_context_function(ctx, namespace, name);
+}
+
 
 void evaluate_source(char *type, char *source, bool expression, bool print_nil, char *set_ns, const char *theme,
                 bool block_until_ready, int session_id) {
@@ -197,7 +203,19 @@ void evaluate_source(char *type, char *source, bool expression, bool print_nil,
         }
     }
 
+    static JSObjectRef execute_fn = NULL;
+
     acquire_eval_lock();
+    if (!execute_fn) {
+        execute_fn = get_function("planck.repl", "execute");
+        JSValueProtect(ctx, execute_fn);
+    }
+    execute_source(ctx, execute_fn, type, source, expression, print_nil, set_ns, theme, session_id);
+    release_eval_lock();
+}
+
+void execute_source(JSContextRef ctx, JSObjectRef execute_fn, char *type, char *source, bool expression,
+                    bool print_nil, char *set_ns, const char *theme, int session_id) {
     JSValueRef args[6];
     size_t num_args = 6;
 
@@ -220,64 +238,13 @@ void evaluate_source(char *type, char *source, bool expression, bool print_nil,
     args[4] = JSValueMakeString(ctx, theme_str);
     args[5] = JSValueMakeNumber(ctx, session_id);
 
-    static JSObjectRef execute_fn = NULL;
-    if (!execute_fn) {
-        execute_fn = get_function("planck.repl", "execute");
-        JSValueProtect(ctx, execute_fn);
-    }
     JSObjectRef global_obj = JSContextGetGlobalObject(ctx);
 
     JSObjectCallAsFunction(ctx, execute_fn, global_obj, num_args, args, NULL);
-    release_eval_lock();
 }
 
-void bootstrap(char *out_path) {
-    char *deps_file_path = "main.js";
-    char *goog_base_path = "goog/base.js";
-    if (out_path != NULL) {
-        deps_file_path = str_concat(out_path, deps_file_path);
-        goog_base_path = str_concat(out_path, goog_base_path);
-    }
-
-    char source[] = "<bootstrap>";
-
-    // Setup CLOSURE_IMPORT_SCRIPT
-    evaluate_script(ctx, "CLOSURE_IMPORT_SCRIPT = function(src) { AMBLY_IMPORT_SCRIPT('goog/' + src); return true; }",
-                    source);
-
-    // Load goog base
-    char *base_script_str = NULL;
-    if (out_path) {
-        base_script_str = get_contents(goog_base_path, NULL);
-        free(goog_base_path);
-    } else {
-        base_script_str = bundle_get_contents(goog_base_path);
-    }
-    if (base_script_str == NULL) {
-        fprintf(stderr, "The goog base JavaScript text could not be loaded\n");
-        exit(1);
-    }
-    evaluate_script(ctx, base_script_str, "<bootstrap:base>");
-    free(base_script_str);
-
-    // Load the deps file
-    char *deps_script_str = NULL;
-    if (out_path) {
-        deps_script_str = get_contents(deps_file_path, NULL);
-        free(deps_file_path);
-    } else {
-        deps_script_str = bundle_get_contents(deps_file_path);
-    }
-    if (deps_script_str == NULL) {
-        fprintf(stderr, "The deps JavaScript text could not be loaded\n");
-        exit(1);
-    }
-    evaluate_script(ctx, deps_script_str, "<bootstrap:deps>");
-    free(deps_script_str);
-
-    evaluate_script(ctx, "goog.require('cljs.core');", source);
-
-    evaluate_script(ctx, "goog.isProvided_ = function(x) { return false; };", source);
+void init_goog_require(JSContextRef ctx) {
+    evaluate_script(ctx, "goog.isProvided_ = function(x) { return false; };", "<bootstrap>");
 
     // redef goog.require to track loaded libs
     evaluate_script(ctx,
@@ -307,7 +274,79 @@ void bootstrap(char *out_path) {
                     "  } else {\n"
                     "    return ret;\n"
                     "  }\n"
-                    "};", source);
+                    "};", "<bootstrap>");
+}
+
+void bootstrap(char *out_path) {
+    char *deps_file_path = "main.js";
+    char *goog_base_path = "goog/base.js";
+    if (out_path != NULL) {
+        deps_file_path = str_concat(out_path, deps_file_path);
+        goog_base_path = str_concat(out_path, goog_base_path);
+    }
+
+    char source[] = "<bootstrap>";
+
+    // Setup CLOSURE_IMPORT_SCRIPT
+    evaluate_script(ctx, "CLOSURE_IMPORT_SCRIPT = function(src) { AMBLY_IMPORT_SCRIPT('goog/' + src); return true; }",
+                    source);
+
+    snapshot_begin_segment("bootstrap");
+
+    if (!snapshot_replay_segment(ctx, "bootstrap")) {
+        // Load the deps file
+        char *deps_script_str = NULL;
+        const char *deps_script = NULL;
+        if (out_path) {
+            deps_script_str = get_contents(deps_file_path, NULL);
+            free(deps_file_path);
+        } else if ((deps_script = bundle_get_view(deps_file_path, NULL)) == NULL) {
+            deps_script_str = bundle_get_contents(deps_file_path);
+        }
+        if (deps_script_str != NULL) {
+            deps_script = deps_script_str;
+        }
+        if (deps_script == NULL) {
+            fprintf(stderr, "The deps JavaScript text could not be loaded\n");
+            exit(1);
+        }
+
+        // With a compressed bundle, start inflating the scripts the deps file
+        // will lead to while goog base is evaluated
+        if (deps_script_str != NULL && out_path == NULL) {
+            prefetch_start(deps_script_str);
+        }
+
+        // Load goog base
+        char *base_script_str = NULL;
+        const char *base_script = NULL;
+        if (out_path) {
+            base_script_str = get_contents(goog_base_path, NULL);
+            free(goog_base_path);
+        } else if ((base_script = bundle_get_view(goog_base_path, NULL)) == NULL) {
+            base_script_str = bundle_get_contents(goog_base_path);
+        }
+        if (base_script_str != NULL) {
+            base_script = base_script_str;
+        }
+        if (base_script == NULL) {
+            fprintf(stderr, "The goog base JavaScript text could not be loaded\n");
+            exit(1);
+        }
+        snapshot_record_script("<bootstrap:base>", base_script);
+        evaluate_script(ctx, base_script, "<bootstrap:base>");
+        free(base_script_str);
+
+        snapshot_record_script("<bootstrap:deps>", deps_script);
+        evaluate_script(ctx, deps_script, "<bootstrap:deps>");
+        free(deps_script_str);
+    }
+
+    evaluate_script(ctx, "goog.require('cljs.core');", source);
+
+    snapshot_end_segment();
+
+    init_goog_require(ctx);
 }
 
 void run_main_in_ns(char *ns, size_t argc, char **argv) {
@@ -432,6 +471,72 @@ void init_paredit(JSContextRef ctx) {
     }
 }
 
+const char *repl_requires_source =
+        "(eval `(~'ns ~'cljs.user (:require ~@(-> @planck.repl/app-env :opts (:repl-requires "
+        "'[[planck.repl :refer-macros [source doc find-doc apropos dir pst]]])))))";
+
+void init_planck_repl(JSContextRef ctx) {
+    {
+        JSValueRef arguments[config.num_rest_args];
+        int i;
+        for (i = 0; i < config.num_rest_args; i++) {
+            arguments[i] = c_string_to_value(ctx, config.rest_args[i]);
+        }
+        JSValueRef args_ref = JSObjectMakeArray(ctx, config.num_rest_args, arguments, NULL);
+
+        JSValueRef global_obj = JSContextGetGlobalObject(ctx);
+        JSStringRef prop = JSStringCreateWithUTF8CString("PLANCK_INITIAL_COMMAND_LINE_ARGS");
+        JSObjectSetProperty(ctx, JSValueToObject(ctx, global_obj, NULL), prop, args_ref, kJSPropertyAttributeNone,
+                            NULL);
+        JSStringRelease(prop);
+    }
+
+    {
+        JSValueRef arguments[9];
+        arguments[0] = JSValueMakeBoolean(ctx, config.repl);
+        arguments[1] = JSValueMakeBoolean(ctx, config.verbose);
+        JSValueRef cache_path_ref = NULL;
+        if (config.cache_path != NULL) {
+            JSStringRef cache_path_str = JSStringCreateWithUTF8CString(config.cache_path);
+            cache_path_ref = JSValueMakeString(ctx, cache_path_str);
+        }
+        arguments[2] = cache_path_ref;
+        JSValueRef checked_arrays_ref = NULL;
+        if (config.checked_arrays != NULL) {
+            JSStringRef checked_arrays_str = JSStringCreateWithUTF8CString(config.checked_arrays);
+            checked_arrays_ref = JSValueMakeString(ctx, checked_arrays_str);
+        }
+        arguments[3] = checked_arrays_ref;
+        arguments[4] = JSValueMakeBoolean(ctx, config.static_fns);
+        arguments[5] = JSValueMakeBoolean(ctx, config.fn_invoke_direct);
+        arguments[6] = JSValueMakeBoolean(ctx, config.elide_asserts);
+        JSStringRef optimizations_str = JSStringCreateWithUTF8CString(config.optimizations);
+        JSValueRef optimizations_ref = JSValueMakeString(ctx, optimizations_str);
+        arguments[7] = optimizations_ref;
+
+        JSValueRef compile_opts[config.num_compile_opts];
+        size_t i;
+        for (i=0; i<config.num_compile_opts; i++) {
+            JSStringRef compile_opts_str = JSStringCreateWithUTF8CString(config.compile_opts[i]);
+            compile_opts[i] = JSValueMakeString(ctx, compile_opts_str);
+        }
+        arguments[8] = JSObjectMakeArray(ctx, config.num_compile_opts, compile_opts, NULL);
+
+        JSValueRef ex = NULL;
+        JSObjectCallAsFunction(ctx, get_context_function(ctx, "planck.repl", "init"), JSContextGetGlobalObject(ctx), 9,
+                               arguments, &ex);
+        debug_print_value("planck.repl/init", ctx, ex);
+
+        if (ex) {
+            print_value("Error initializing engine: ", ctx, ex);
+        }
+    }
+
+    char version_script[1024];
+    snprintf(version_script, 1024, "cljs.core._STAR_clojurescript_version_STAR_ = \"%s\";", config.clojurescript_version);
+    evaluate_script(ctx, version_script, "<init>");
+}
+
 void *do_engine_init(void *data) {
     ctx = JSGlobalContextCreate(NULL);
 
@@ -439,6 +544,18 @@ void *do_engine_init(void *data) {
 
     evaluate_script(ctx, "var global = this;", "<init>");
 
+    if (config.out_path == NULL) {
+        if (config.snapshot_in_path != NULL) {
+            if (snapshot_load(config.snapshot_in_path) < 0) {
+                fprintf(stderr, "Warning: Ignoring snapshot %s: %s\n", config.snapshot_in_path,
+                        errno == EINVAL ? "created by a different version of Planck" : strerror(errno));
+            }
+            display_launch_timing("load snapshot");
+        } else if (config.snapshot_out_path != NULL) {
+            snapshot_start_recording();
+        }
+    }
+
     register_global_function(ctx, "AMBLY_IMPORT_SCRIPT", function_import_script);
     bootstrap(config.out_path);
 
@@ -452,7 +569,10 @@ void *do_engine_init(void *data) {
     display_launch_timing("version");
 
     // require app namespaces
+    snapshot_begin_segment("app");
+    snapshot_replay_segment(ctx, "app");
     evaluate_script(ctx, "goog.require('planck.repl');", "<init>");
+    snapshot_end_segment();
 
     display_launch_timing("require app namespaces");
 
@@ -463,10 +583,15 @@ void *do_engine_init(void *data) {
 
     register_global_function(ctx, "PLANCK_READ_FILE", function_read_file);
     register_global_function(ctx, "PLANCK_LOAD", function_load);
+    register_global_function(ctx, "PLANCK_BUNDLE_EXISTS", function_bundle_exists);
+    register_global_function(ctx, "PLANCK_RUNTIME_STATS", function_runtime_stats);
     register_global_function(ctx, "PLANCK_LOAD_DEPS_CLJS_FILES", function_load_deps_cljs_files);
     register_global_function(ctx, "PLANCK_LOAD_DATA_READERS_FILES", function_load_data_readers_files);
     register_global_function(ctx, "PLANCK_LOAD_FROM_JAR", function_load_from_jar);
     register_global_function(ctx, "PLANCK_CACHE", function_cache);
+    register_global_function(ctx, "PLANCK_CACHE_PUT", function_cache_put);
+    register_global_function(ctx, "PLANCK_CACHE_GET", function_cache_get);
+    register_global_function(ctx, "PLANCK_WRITE_CACHE_MANIFEST", function_write_cache_manifest);
 
     register_global_function(ctx, "PLANCK_EVAL", function_eval);
 
@@ -477,6 +602,7 @@ void *do_engine_init(void *data) {
     register_global_function(ctx, "PLANCK_SHELL_SH", function_shellexec);
 
     register_global_function(ctx, "PLANCK_RAW_READ_STDIN", function_raw_read_stdin);
+    register_global_function(ctx, "PLANCK_READ_LINES", function_read_lines);
     register_global_function(ctx, "PLANCK_RAW_WRITE_STDOUT", function_raw_write_stdout);
     register_global_function(ctx, "PLANCK_RAW_FLUSH_STDOUT", function_raw_flush_stdout);
     register_global_function(ctx, "PLANCK_RAW_WRITE_STDERR", function_raw_write_stderr);
@@ -503,12 +629,20 @@ void *do_engine_init(void *data) {
     register_global_function(ctx, "PLANCK_MKDIRS", function_mkdirs);
     register_global_function(ctx, "PLANCK_DELETE", function_delete_file);
     register_global_function(ctx, "PLANCK_COPY", function_copy_file);
+    register_global_function(ctx, "PLANCK_COPY_TREE", function_copy_tree);
+    register_global_function(ctx, "PLANCK_READ_ASYNC", function_read_async);
+    register_global_function(ctx, "PLANCK_WRITE_ASYNC", function_write_async);
+    register_global_function(ctx, "PLANCK_COPY_ASYNC", function_copy_async);
 
     register_global_function(ctx, "PLANCK_LIST_FILES", function_list_files);
+    register_global_function(ctx, "PLANCK_WALK_OPEN", function_walk_open);
+    register_global_function(ctx, "PLANCK_WALK", function_walk);
+    register_global_function(ctx, "PLANCK_WALK_CLOSE", function_walk_close);
 
     register_global_function(ctx, "PLANCK_IS_DIRECTORY", function_is_directory);
 
     register_global_function(ctx, "PLANCK_FSTAT", function_fstat);
+    register_global_function(ctx, "PLANCK_FSTAT_MANY", function_fstat_many);
 
     register_global_function(ctx, "PLANCK_MKTEMP", function_mktemp);
 
@@ -523,6 +657,10 @@ void *do_engine_init(void *data) {
     register_global_function(ctx, "PLANCK_SOCKET_WRITE", function_socket_write);
     register_global_function(ctx, "PLANCK_SOCKET_CLOSE", function_socket_close);
 
+    register_global_function(ctx, "PLANCK_WORKER_START", function_worker_start);
+    register_global_function(ctx, "PLANCK_WORKER_POST", function_worker_post);
+    register_global_function(ctx, "PLANCK_WORKER_STOP", function_worker_stop);
+
     register_global_function(ctx, "PLANCK_SLEEP", function_sleep);
 
     register_global_function(ctx, "PLANCK_SIGNAL_TASK_COMPLETE", function_signal_task_complete);
@@ -538,25 +676,10 @@ void *do_engine_init(void *data) {
 
     display_launch_timing("monkey-patch system-time");
 
-    {
-        JSValueRef arguments[config.num_rest_args];
-        int i;
-        for (i = 0; i < config.num_rest_args; i++) {
-            arguments[i] = c_string_to_value(ctx, config.rest_args[i]);
-        }
-        JSValueRef args_ref = JSObjectMakeArray(ctx, config.num_rest_args, arguments, NULL);
-
-        JSValueRef global_obj = JSContextGetGlobalObject(ctx);
-        JSStringRef prop = JSStringCreateWithUTF8CString("PLANCK_INITIAL_COMMAND_LINE_ARGS");
-        JSObjectSetProperty(ctx, JSValueToObject(ctx, global_obj, NULL), prop, args_ref, kJSPropertyAttributeNone,
-                            NULL);
-        JSStringRelease(prop);
-    }
-
-    display_launch_timing("setup command line args");
-
     register_global_function(ctx, "PLANCK_SET_TIMEOUT", function_set_timeout);
     register_global_function(ctx, "PLANCK_SET_INTERVAL", function_set_interval);
+    register_global_function(ctx, "PLANCK_CLEAR_TIMER", function_clear_timer);
+    register_global_function(ctx, "PLANCK_SCHEDULE_IMMEDIATES", function_schedule_immediates);
     evaluate_script(ctx,
                     "var PLANCK_TIMEOUT_CALLBACK_STORE = {};\
                      var setTimeout = function( fn, ms ) {\
@@ -581,15 +704,23 @@ void *do_engine_init(void *data) {
                      var clearTimeout = function( id ) {\
                        if ( PLANCK_TIMEOUT_CALLBACK_STORE[id] ) {\
                          delete PLANCK_TIMEOUT_CALLBACK_STORE[id];\
+                         PLANCK_CLEAR_TIMER(id);\
                          PLANCK_SIGNAL_TASK_COMPLETE();\
                        }\
                      };\
                      var PLANCK_INTERVAL_CALLBACK_STORE = {};\
+                     var PLANCK_INTERVAL_TIMER_STORE = {};\
                      var setInterval = function( fn, ms ) {\
                         if ( cljs.core.fn_QMARK_(fn) ) {\
                           var id = PLANCK_SET_INTERVAL(ms, null);\
+                          PLANCK_INTERVAL_TIMER_STORE[id] = id;\
                           PLANCK_INTERVAL_CALLBACK_STORE[id] = \
-                            function(){ fn(); PLANCK_SET_INTERVAL(ms, id); };\
+                            function(){\
+                              fn();\
+                              if ( PLANCK_INTERVAL_CALLBACK_STORE[id] ) {\
+                                PLANCK_INTERVAL_TIMER_STORE[id] = PLANCK_SET_INTERVAL(ms, id);\
+                              }\
+                            };\
                           return id;\
                         } else {\
                           throw new Error(\"Callback must be a function\");\
@@ -603,8 +734,60 @@ void *do_engine_init(void *data) {
                      var clearInterval = function( id ) {\
                        if ( PLANCK_INTERVAL_CALLBACK_STORE[id] ) {\
                          delete PLANCK_INTERVAL_CALLBACK_STORE[id];\
+                         PLANCK_CLEAR_TIMER(PLANCK_INTERVAL_TIMER_STORE[id]);\
+                         delete PLANCK_INTERVAL_TIMER_STORE[id];\
                          PLANCK_SIGNAL_TASK_COMPLETE();\
                        }\
+                     };\
+                     var PLANCK_IMMEDIATE_ID = 0;\
+                     var PLANCK_IMMEDIATE_QUEUE = [];\
+                     var PLANCK_IMMEDIATE_CALLBACK_STORE = {};\
+                     var PLANCK_IMMEDIATES_SCHEDULED = false;\
+                     var setImmediate = function( fn ) {\
+                       if ( cljs.core.fn_QMARK_(fn) ) {\
+                         var id = ++PLANCK_IMMEDIATE_ID;\
+                         var args = Array.prototype.slice.call(arguments, 1);\
+                         PLANCK_IMMEDIATE_CALLBACK_STORE[id] = \
+                           args.length ? function(){ fn.apply(null, args); } : fn;\
+                         PLANCK_IMMEDIATE_QUEUE.push(id);\
+                         if ( !PLANCK_IMMEDIATES_SCHEDULED ) {\
+                           PLANCK_IMMEDIATES_SCHEDULED = true;\
+                           PLANCK_SCHEDULE_IMMEDIATES();\
+                         }\
+                         return id;\
+                       } else {\
+                         throw new Error(\"Callback must be a function\");\
+                       }\
+                     };\
+                     var PLANCK_RUN_IMMEDIATES = function() {\
+                       var queue = PLANCK_IMMEDIATE_QUEUE;\
+                       PLANCK_IMMEDIATE_QUEUE = [];\
+                       var i = 0;\
+                       try {\
+                         for ( ; i < queue.length; i++ ) {\
+                           var fn = PLANCK_IMMEDIATE_CALLBACK_STORE[queue[i]];\
+                           if ( fn ) {\
+                             delete PLANCK_IMMEDIATE_CALLBACK_STORE[queue[i]];\
+                             fn();\
+                           }\
+                         }\
+                       } finally {\
+                         if ( i < queue.length ) {\
+                           PLANCK_IMMEDIATE_QUEUE = queue.slice(i + 1).concat(PLANCK_IMMEDIATE_QUEUE);\
+                         }\
+                         PLANCK_IMMEDIATES_SCHEDULED = PLANCK_IMMEDIATE_QUEUE.length > 0;\
+                       }\
+                       return PLANCK_IMMEDIATES_SCHEDULED;\
+                     };\
+                     var clearImmediate = function( id ) {\
+                       delete PLANCK_IMMEDIATE_CALLBACK_STORE[id];\
+                     };\
+                     var queueMicrotask = function( fn ) {\
+                       if ( cljs.core.fn_QMARK_(fn) ) {\
+                         Promise.resolve().then(function(){ fn(); });\
+                       } else {\
+                         throw new Error(\"Callback must be a function\");\
+                       }\
                      };",
                     "<init>");
 
@@ -612,57 +795,12 @@ void *do_engine_init(void *data) {
 
     set_print_sender(&discarding_sender);
 
-    {
-        JSValueRef arguments[9];
-        arguments[0] = JSValueMakeBoolean(ctx, config.repl);
-        arguments[1] = JSValueMakeBoolean(ctx, config.verbose);
-        JSValueRef cache_path_ref = NULL;
-        if (config.cache_path != NULL) {
-            JSStringRef cache_path_str = JSStringCreateWithUTF8CString(config.cache_path);
-            cache_path_ref = JSValueMakeString(ctx, cache_path_str);
-        }
-        arguments[2] = cache_path_ref;
-        JSValueRef checked_arrays_ref = NULL;
-        if (config.checked_arrays != NULL) {
-            JSStringRef checked_arrays_str = JSStringCreateWithUTF8CString(config.checked_arrays);
-            checked_arrays_ref = JSValueMakeString(ctx, checked_arrays_str);
-        }
-        arguments[3] = checked_arrays_ref;
-        arguments[4] = JSValueMakeBoolean(ctx, config.static_fns);
-        arguments[5] = JSValueMakeBoolean(ctx, config.fn_invoke_direct);
-        arguments[6] = JSValueMakeBoolean(ctx, config.elide_asserts);
-        JSStringRef optimizations_str = JSStringCreateWithUTF8CString(config.optimizations);
-        JSValueRef optimizations_ref = JSValueMakeString(ctx, optimizations_str);
-        arguments[7] = optimizations_ref;
-
-        JSValueRef compile_opts[config.num_compile_opts];
-        size_t i;
-        for (i=0; i<config.num_compile_opts; i++) {
-            JSStringRef compile_opts_str = JSStringCreateWithUTF8CString(config.compile_opts[i]);
-            compile_opts[i] = JSValueMakeString(ctx, compile_opts_str);
-        }
-        arguments[8] = JSObjectMakeArray(ctx, config.num_compile_opts, compile_opts, NULL);
-
-        JSValueRef ex = NULL;
-        JSObjectCallAsFunction(ctx, get_function("planck.repl", "init"), JSContextGetGlobalObject(ctx), 9,
-                               arguments, &ex);
-        debug_print_value("planck.repl/init", ctx, ex);
-
-        if (ex) {
-            print_value("Error initializing engine: ", ctx, ex);
-        }
-    }
+    init_planck_repl(ctx);
 
     display_launch_timing("planck.repl/init");
 
-    char version_script[1024];
-    snprintf(version_script, 1024, "cljs.core._STAR_clojurescript_version_STAR_ = \"%s\";", config.clojurescript_version);
-    evaluate_script(ctx, version_script, "<init>");
-
     if (config.repl) {
-        evaluate_source("text", "(eval `(~'ns ~'cljs.user (:require ~@(-> @planck.repl/app-env :opts (:repl-requires "
-                                "'[[planck.repl :refer-macros [source doc find-doc apropos dir pst]]])))))",
-                        true, false, "cljs.user", "dumb", false, 0);
+        evaluate_source("text", (char *) repl_requires_source, true, false, "cljs.user", "dumb", false, 0);
         display_launch_timing("repl requires");
     } else {
         evaluate_source("text", "(require 'planck.repl)",
@@ -689,6 +827,15 @@ void *do_engine_init(void *data) {
         init_paredit(ctx);
     }
 
+    prefetch_finish();
+
+    if (snapshot_recording()) {
+        if (snapshot_write(config.snapshot_out_path) < 0) {
+            engine_perror(config.snapshot_out_path);
+        }
+        display_launch_timing("write snapshot");
+    }
+
     display_launch_timing("engine ready");
 
     signal_engine_ready();
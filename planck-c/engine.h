@@ -15,16 +15,34 @@ bool should_keep_running();
 void evaluate_source(char *type, char *source_value, bool expression, bool print_nil, char *set_ns,
                            const char *theme, bool block_until_ready, int session_id);
 
+// Calls planck.repl/execute (execute_fn) in ctx, which the caller must have
+// locked, if it is shared.
+void execute_source(JSContextRef ctx, JSObjectRef execute_fn, char *type, char *source, bool expression,
+                    bool print_nil, char *set_ns, const char *theme, int session_id);
+
 char *munge(char *s);
 
 void bootstrap(char *out_path);
 
+void init_goog_require(JSContextRef ctx);
+
+void init_planck_repl(JSContextRef ctx);
+
+// The source evaluated in cljs.user to require the namespaces a REPL uses
+extern const char *repl_requires_source;
+
 int block_until_engine_ready();
 
 extern const char *block_until_engine_ready_failed_msg;
 
+JSValueRef get_value_on_object(JSContextRef ctx, JSObjectRef obj, char *name);
+
 JSObjectRef get_function(char *namespace, char *name);
 
+JSObjectRef get_context_function(JSContextRef ctx, char *namespace, char *name);
+
+void register_global_function(JSContextRef ctx, char *name, JSObjectCallAsFunctionCallback handler);
+
 void run_main_in_ns(char *ns, size_t argc, char **argv);
 
 void run_main_cli_fn();
@@ -0,0 +1,236 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "engine.h"
+#include "event_loop.h"
+
+// Posted events are pushed onto a lock-free stack, which the loop takes as a
+// whole and reverses, so that events run in the order they were posted.
+// Posting only makes a system call when the loop is asleep, in which case it
+// writes to a descriptor (an eventfd on Linux, otherwise a pipe) that the loop
+// is polling.
+
+// The most events run each time the eval lock is taken, so that the REPL and
+// other users of the lock aren't kept waiting behind a long queue
+#define EVENT_LOOP_BATCH_SIZE 256
+
+struct event {
+    event_loop_fn_t fn;
+    void *data;
+    struct event *next;
+};
+
+static _Atomic(struct event *) posted = NULL;
+static atomic_bool sleeping = false;
+static atomic_bool started = false;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t loop_thread;
+static int wake_read_fd = -1;
+static int wake_write_fd = -1;
+
+static void wait_for_wake() {
+    struct pollfd pfd;
+    pfd.fd = wake_read_fd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {}
+
+    uint64_t buf[8];
+    while (read(wake_read_fd, buf, sizeof(buf)) > 0) {}
+}
+
+static void wake() {
+    if (atomic_exchange(&sleeping, false)) {
+        uint64_t one = 1;
+        ssize_t n = write(wake_write_fd, &one, sizeof(one));
+        (void) n;
+    }
+}
+
+static struct event *take_posted() {
+    struct event *events = atomic_exchange(&posted, NULL);
+    struct event *reversed = NULL;
+    while (events) {
+        struct event *next = events->next;
+        events->next = reversed;
+        reversed = events;
+        events = next;
+    }
+    return reversed;
+}
+
+static void *run_loop(void *arg) {
+    struct event *events = NULL;
+    for (;;) {
+        if (events == NULL) {
+            events = take_posted();
+        }
+
+        if (events == NULL) {
+            atomic_store(&sleeping, true);
+            // An event posted before sleeping was set would not have woken us
+            if (atomic_load(&posted) == NULL) {
+                wait_for_wake();
+            }
+            atomic_store(&sleeping, false);
+            continue;
+        }
+
+        acquire_eval_lock();
+        int n;
+        for (n = 0; events != NULL && n < EVENT_LOOP_BATCH_SIZE; n++) {
+            struct event *event = events;
+            events = event->next;
+            event->fn(event->data);
+            free(event);
+        }
+        release_eval_lock();
+    }
+    return NULL;
+}
+
+static int open_wake_fds() {
+#ifdef __linux__
+    wake_read_fd = wake_write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return wake_read_fd == -1 ? errno : 0;
+#else
+    int fds[2];
+    if (pipe(fds) == -1) {
+        return errno;
+    }
+    int i;
+    for (i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    wake_read_fd = fds[0];
+    wake_write_fd = fds[1];
+    return 0;
+#endif
+}
+
+static void start_loop() {
+    pthread_mutex_lock(&start_lock);
+    if (!atomic_load(&started)) {
+        int err = wake_read_fd == -1 ? open_wake_fds() : 0;
+        if (!err) {
+            pthread_attr_t attr;
+            err = pthread_attr_init(&attr);
+            if (!err) {
+                err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+                if (!err) {
+                    err = pthread_create(&loop_thread, &attr, run_loop, NULL);
+                }
+                pthread_attr_destroy(&attr);
+            }
+        }
+        if (err) {
+            // Events stay queued, and starting is tried again on the next post
+            engine_print_err_message("event loop", err);
+        } else {
+            atomic_store(&started, true);
+        }
+    }
+    pthread_mutex_unlock(&start_lock);
+}
+
+void event_loop_post(event_loop_fn_t fn, void *data) {
+    struct event *event = malloc(sizeof(struct event));
+    event->fn = fn;
+    event->data = data;
+    event->next = atomic_load(&posted);
+    while (!atomic_compare_exchange_weak(&posted, &event->next, event)) {}
+
+    if (!atomic_load(&started)) {
+        start_loop();
+    }
+    wake();
+}
+
+struct call {
+    event_loop_fn_t fn;
+    void *data;
+    bool done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void run_call(void *data) {
+    struct call *call = data;
+    call->fn(call->data);
+
+    pthread_mutex_lock(&call->lock);
+    call->done = true;
+    pthread_cond_signal(&call->cond);
+    pthread_mutex_unlock(&call->lock);
+}
+
+// Runs everything posted so far, and then fn, on the calling thread, as the
+// loop would
+static void run_inline(event_loop_fn_t fn, void *data) {
+    acquire_eval_lock();
+    struct event *events = take_posted();
+    while (events != NULL) {
+        struct event *event = events;
+        events = event->next;
+        event->fn(event->data);
+        free(event);
+    }
+    fn(data);
+    release_eval_lock();
+}
+
+void event_loop_call(event_loop_fn_t fn, void *data) {
+    if (atomic_load(&started) && pthread_equal(pthread_self(), loop_thread)) {
+        fn(data);
+        return;
+    }
+
+    // Waiting on a loop that couldn't be started would never end
+    if (!atomic_load(&started)) {
+        start_loop();
+        if (!atomic_load(&started)) {
+            run_inline(fn, data);
+            return;
+        }
+    }
+
+    struct call call;
+    call.fn = fn;
+    call.data = data;
+    call.done = false;
+    pthread_mutex_init(&call.lock, NULL);
+    pthread_cond_init(&call.cond, NULL);
+
+    event_loop_post(run_call, &call);
+
+    pthread_mutex_lock(&call.lock);
+    while (!call.done) {
+        pthread_cond_wait(&call.cond, &call.lock);
+    }
+    pthread_mutex_unlock(&call.lock);
+
+    pthread_mutex_destroy(&call.lock);
+    pthread_cond_destroy(&call.cond);
+}
+
+static void do_nothing(void *data) {
+}
+
+void event_loop_flush(void) {
+    // Nothing can have been posted if the loop was never started, unless
+    // starting it failed
+    if (atomic_load(&started) || atomic_load(&posted) != NULL) {
+        event_loop_call(do_nothing, NULL);
+    }
+}
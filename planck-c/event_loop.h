@@ -0,0 +1,19 @@
+// An event loop on which callbacks into JavaScript from other threads are
+// run, one after another and in the order they were posted, in batches with
+// the eval lock held.
+
+typedef void (*event_loop_fn_t)(void *data);
+
+// Queues fn to be called with data on the loop's thread, starting the loop
+// on first use. Never waits for the loop, so it can be called with the eval
+// lock held.
+void event_loop_post(event_loop_fn_t fn, void *data);
+
+// Posts fn as event_loop_post does and waits for it to have been called. If
+// the loop can't be started, instead calls fn, after anything already posted,
+// on the calling thread, with the eval lock held. Must not be called with the
+// eval lock held.
+void event_loop_call(event_loop_fn_t fn, void *data);
+
+// Waits for everything posted so far to have been called.
+void event_loop_flush(void);
@@ -1,8 +1,15 @@
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <search.h>
+#include <unistd.h>
 #include <JavaScriptCore/JavaScript.h>
+#include "unicode/ucnv.h"
+#include "unicode/ustring.h"
 #include "unicode/ustdio.h"
 #include "file.h"
+#include "io.h"
 
 descriptor_t ufile_to_descriptor(UFILE *ufile) {
     return (descriptor_t) ufile;
@@ -16,28 +23,331 @@ descriptor_t ufile_open(const char *path, const char *encoding, const char *mode
     return ufile_to_descriptor(u_fopen(path, mode, NULL, encoding));
 }
 
-descriptor_t ufile_open_read(const char *path, const char *encoding) {
-    return ufile_open(path, encoding, "r");
+// Text is read by converting large chunks of bytes with a converter that
+// lives as long as the reader, rather than through a UFILE, which converts
+// through a small internal buffer on every read. Converted characters not
+// yet returned are kept between calls, so reads and line reads can be mixed.
+struct ufile_reader {
+    FILE *file;
+    int fd;
+    bool owns_file;
+    UConverter *converter;
+    char *bytes;
+    size_t bytes_size;
+    size_t read_size;
+    const char *pending;
+    const char *pending_end;
+    UChar *chars;
+    int32_t chars_size;
+    int32_t chars_start;
+    int32_t chars_end;
+};
+
+static descriptor_t make_reader(FILE *file, int fd, bool owns_file, const char *encoding, size_t buffer_size,
+                                size_t read_size) {
+    UErrorCode status = U_ZERO_ERROR;
+    UConverter *converter = ucnv_open(encoding, &status);
+    if (U_FAILURE(status)) {
+        return 0;
+    }
+
+    struct ufile_reader *reader = malloc(sizeof(struct ufile_reader));
+    reader->file = file;
+    reader->fd = fd;
+    reader->owns_file = owns_file;
+    reader->converter = converter;
+    reader->bytes_size = buffer_size;
+    reader->bytes = malloc(buffer_size);
+    reader->read_size = read_size < buffer_size ? read_size : buffer_size;
+    reader->pending = reader->pending_end = reader->bytes;
+    reader->chars_size = (int32_t) buffer_size;
+    reader->chars = malloc(sizeof(UChar) * buffer_size);
+    reader->chars_start = reader->chars_end = 0;
+    return (descriptor_t) reader;
+}
+
+descriptor_t ufile_open_read(const char *path, const char *encoding, size_t buffer_size) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    if (buffer_size == 0) {
+        buffer_size = UFILE_READ_BUFFER_SIZE;
+    }
+
+    descriptor_t descriptor = make_reader(file, -1, true, encoding, buffer_size, buffer_size);
+    if (descriptor == 0) {
+        fclose(file);
+    }
+    return descriptor;
+}
+
+descriptor_t ufile_open_stdin(size_t read_size) {
+    return make_reader(stdin, -1, false, "UTF-8", UFILE_READ_BUFFER_SIZE, read_size);
+}
+
+descriptor_t ufile_open_fd(int fd, const char *encoding, size_t buffer_size) {
+    return make_reader(NULL, fd, false, encoding, buffer_size, buffer_size);
 }
 
 descriptor_t ufile_open_write(const char *path, bool append, const char *encoding) {
     return ufile_open(path, encoding, (append ? "a" : "w"));
 }
 
-JSStringRef ufile_read(descriptor_t descriptor) {
-    UFILE *ufile = descriptor_to_ufile(descriptor);
-    JSStringRef rv = NULL;
-    void *buffer = malloc(sizeof(uint16_t) * 1024);
-    int32_t read = u_file_read(buffer, 1024, ufile);
+static size_t read_bytes(struct ufile_reader *reader) {
+    if (reader->file == NULL) {
+        for (;;) {
+            ssize_t n = read(reader->fd, reader->bytes, reader->read_size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return n > 0 ? (size_t) n : 0;
+        }
+    }
+
+    size_t read = fread(reader->bytes, 1, reader->read_size, reader->file);
     /* If we've read to the end of the file, clear the EOF indicator
      * so that subsequent read calls will try again. */
-    if (u_feof(ufile)) {
-        clearerr(u_fgetfile(ufile));
+    if (read == 0) {
+        clearerr(reader->file);
+    }
+    return read;
+}
+
+// Converts the next chunk of the file onto the end of the buffered
+// characters, making room for it first, and returns the number of characters
+// added, which is 0 only at the end of the file
+static int32_t fill_chars(struct ufile_reader *reader) {
+    if (reader->chars_start == reader->chars_end) {
+        reader->chars_start = reader->chars_end = 0;
+    } else if (reader->chars_end == reader->chars_size) {
+        if (reader->chars_start > 0) {
+            memmove(reader->chars, reader->chars + reader->chars_start,
+                    sizeof(UChar) * (reader->chars_end - reader->chars_start));
+            reader->chars_end -= reader->chars_start;
+            reader->chars_start = 0;
+        } else {
+            // A line longer than the buffer
+            reader->chars_size *= 2;
+            reader->chars = realloc(reader->chars, sizeof(UChar) * reader->chars_size);
+        }
+    }
+
+    UChar *target = reader->chars + reader->chars_end;
+    UChar *target_limit = reader->chars + reader->chars_size;
+
+    // Carry any bytes that didn't fit over to the next call, and read again
+    // if a chunk ends part way through the only character in it
+    for (;;) {
+        bool flush = false;
+        if (reader->pending == reader->pending_end) {
+            size_t read = read_bytes(reader);
+            flush = read == 0;
+            reader->pending = reader->bytes;
+            reader->pending_end = reader->bytes + read;
+        }
+
+        UErrorCode status = U_ZERO_ERROR;
+        ucnv_toUnicode(reader->converter, &target, target_limit, &reader->pending, reader->pending_end,
+                       NULL, flush, &status);
+        if (target > reader->chars + reader->chars_end || flush || U_FAILURE(status)) {
+            break;
+        }
+    }
+
+    int32_t added = (int32_t) (target - (reader->chars + reader->chars_end));
+    reader->chars_end += added;
+    return added;
+}
+
+JSStringRef ufile_read(descriptor_t descriptor) {
+    struct ufile_reader *reader = (struct ufile_reader *) descriptor;
+    if (reader->chars_start == reader->chars_end && fill_chars(reader) == 0) {
+        return NULL;
+    }
+
+    JSStringRef rv = JSStringCreateWithCharacters(reader->chars + reader->chars_start,
+                                                  (size_t) (reader->chars_end - reader->chars_start));
+    reader->chars_start = reader->chars_end;
+    return rv;
+}
+
+static JSStringRef take_chars(struct ufile_reader *reader, int32_t end) {
+    JSStringRef rv = JSStringCreateWithCharacters(reader->chars + reader->chars_start,
+                                                  (size_t) (end - reader->chars_start));
+    reader->chars_start = end;
+    return rv;
+}
+
+size_t ufile_read_lines(descriptor_t descriptor, size_t max_lines, JSStringRef *lines) {
+    struct ufile_reader *reader = (struct ufile_reader *) descriptor;
+    size_t count = 0;
+    int32_t scanned = reader->chars_start;
+    while (count < max_lines) {
+        UChar *newline = u_memchr(reader->chars + scanned, '\n', reader->chars_end - scanned);
+        if (newline != NULL) {
+            scanned = (int32_t) (newline - reader->chars) + 1;
+            lines[count++] = take_chars(reader, scanned);
+            continue;
+        }
+
+        // Only read more if there are no complete lines to return, so as to
+        // not block when reading interactively
+        if (count > 0) {
+            break;
+        }
+
+        int32_t offset = reader->chars_end - reader->chars_start;
+        if (fill_chars(reader) == 0) {
+            if (reader->chars_start < reader->chars_end) {
+                lines[count++] = take_chars(reader, reader->chars_end);
+            }
+            break;
+        }
+        scanned = reader->chars_start + offset;
+    }
+    return count;
+}
+
+void ufile_close_read(descriptor_t descriptor) {
+    struct ufile_reader *reader = (struct ufile_reader *) descriptor;
+    if (reader->owns_file) {
+        fclose(reader->file);
     }
-    if (read > 0) {
-        rv = JSStringCreateWithCharacters(buffer, (size_t) read);
+    ucnv_close(reader->converter);
+    free(reader->bytes);
+    free(reader->chars);
+    free(reader);
+}
+
+JSStringRef utf8_to_string(const char *utf8, size_t length) {
+    if (length >= INT32_MAX) {
+        errno = EFBIG;
+        return NULL;
+    }
+
+    // UTF-8 never takes fewer bytes than UTF-16 code units
+    UChar *buffer = malloc(sizeof(UChar) * (length + 1));
+    int32_t n = 0;
+    UErrorCode status = U_ZERO_ERROR;
+    u_strFromUTF8WithSub(buffer, (int32_t) length + 1, &n, utf8, (int32_t) length, 0xFFFD, NULL, &status);
+    JSStringRef string = NULL;
+    if (U_SUCCESS(status)) {
+        string = JSStringCreateWithCharacters((const JSChar *) buffer, (size_t) n);
     }
     free(buffer);
+    return string;
+}
+
+typedef struct {
+    UConverter *converter;
+    UChar *buffer;
+    int32_t length;
+    UErrorCode status;
+} ufile_decode_t;
+
+static void ufile_decode_view(const char *contents, size_t length, void *data) {
+    ufile_decode_t *decode = data;
+
+    // Each byte decodes to at most one code unit in most encodings, so
+    // preflight only when that isn't enough
+    int32_t capacity = (int32_t) length + 1;
+    decode->buffer = malloc(sizeof(UChar) * capacity);
+    decode->length = ucnv_toUChars(decode->converter, decode->buffer, capacity, contents, (int32_t) length,
+                                   &decode->status);
+    if (decode->status == U_BUFFER_OVERFLOW_ERROR) {
+        decode->status = U_ZERO_ERROR;
+        capacity = decode->length + 1;
+        decode->buffer = realloc(decode->buffer, sizeof(UChar) * capacity);
+        decode->length = ucnv_toUChars(decode->converter, decode->buffer, capacity, contents, (int32_t) length,
+                                       &decode->status);
+    }
+}
+
+int ufile_read_all(const char *path, const char *encoding, JSChar **chars, size_t *length) {
+    UErrorCode status = U_ZERO_ERROR;
+    UConverter *converter = ucnv_open(encoding, &status);
+    if (U_FAILURE(status)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    contents_view_t view;
+    if (get_contents_view(path, NULL, &view) < 0) {
+        int saved_errno = errno;
+        ucnv_close(converter);
+        errno = saved_errno;
+        return -1;
+    }
+
+    int rv = -1;
+    if (view.length >= INT32_MAX) {
+        errno = EFBIG;
+        goto done;
+    }
+
+    ufile_decode_t decode = {converter, NULL, 0, U_ZERO_ERROR};
+    if (with_contents_view(&view, ufile_decode_view, &decode) < 0) {
+        free(decode.buffer);
+        goto done;
+    }
+    if (U_FAILURE(decode.status)) {
+        free(decode.buffer);
+        errno = EILSEQ;
+        goto done;
+    }
+
+    *chars = (JSChar *) decode.buffer;
+    *length = (size_t) decode.length;
+    rv = 0;
+
+    done:
+    {
+        int saved_errno = errno;
+        release_contents_view(&view);
+        ucnv_close(converter);
+        errno = saved_errno;
+    }
+    return rv;
+}
+
+int ufile_write_all(const char *path, bool append, const char *encoding, const JSChar *chars, size_t length) {
+    if (length >= INT32_MAX / 4) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    UErrorCode status = U_ZERO_ERROR;
+    UConverter *converter = ucnv_open(encoding, &status);
+    if (U_FAILURE(status)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int32_t capacity = UCNV_GET_MAX_BYTES_FOR_STRING((int32_t) length, ucnv_getMaxCharSize(converter));
+    char *bytes = malloc((size_t) capacity);
+    int32_t n = ucnv_fromUChars(converter, bytes, capacity, (const UChar *) chars, (int32_t) length, &status);
+    ucnv_close(converter);
+    if (U_FAILURE(status)) {
+        free(bytes);
+        errno = EILSEQ;
+        return -1;
+    }
+
+    int rv = -1;
+    FILE *file = fopen(path, append ? "a" : "w");
+    if (file != NULL) {
+        bool failed = fwrite(bytes, 1, (size_t) n, file) != (size_t) n;
+        int saved_errno = errno;
+        if (fclose(file) == 0 && !failed) {
+            rv = 0;
+        } else if (failed) {
+            errno = saved_errno;
+        }
+    }
+
+    free(bytes);
     return rv;
 }
 
@@ -2,12 +2,46 @@
 
 typedef unsigned long descriptor_t;
 
-descriptor_t ufile_open_read(const char *path, const char *encoding);
+#define UFILE_READ_BUFFER_SIZE 8192
+
+// Opens a file for reading text, converting from encoding. Each read returns
+// up to buffer_size UTF-16 code units, or UFILE_READ_BUFFER_SIZE if 0.
+descriptor_t ufile_open_read(const char *path, const char *encoding, size_t buffer_size);
+
+// Opens a reader on standard input, decoding UTF-8 and reading at most
+// read_size bytes at a time.
+descriptor_t ufile_open_stdin(size_t read_size);
+
+// Opens a reader that reads fd directly, rather than through stdio, in
+// chunks of up to buffer_size bytes. The descriptor is not closed when the
+// reader is.
+descriptor_t ufile_open_fd(int fd, const char *encoding, size_t buffer_size);
 
 descriptor_t ufile_open_write(const char *path, bool append, const char *encoding);
 
 JSStringRef ufile_read(descriptor_t descriptor);
 
+// Reads up to max_lines lines into lines, each including its terminating
+// newline (absent only on a final line at the end of the file), returning
+// the number read, which is 0 at the end of the file. Reads further only if
+// no complete line is buffered.
+size_t ufile_read_lines(descriptor_t descriptor, size_t max_lines, JSStringRef *lines);
+
+void ufile_close_read(descriptor_t descriptor);
+
+// Reads the whole of the file at path, decoding it from encoding into a
+// malloc'd buffer of UTF-16 code units. Returns 0, or -1 with errno set.
+int ufile_read_all(const char *path, const char *encoding, JSChar **chars, size_t *length);
+
+// Decodes length bytes of UTF-8, which need not be NUL-terminated, into a
+// string, replacing ill-formed sequences with U+FFFD. Returns NULL, with
+// errno set, if it is too long.
+JSStringRef utf8_to_string(const char *utf8, size_t length);
+
+// Writes (or appends) UTF-16 code units to the file at path, encoded in
+// encoding. Returns 0, or -1 with errno set.
+int ufile_write_all(const char *path, bool append, const char *encoding, const JSChar *chars, size_t length);
+
 void ufile_write(descriptor_t descriptor, JSStringRef text);
 
 void ufile_flush(descriptor_t descriptor);
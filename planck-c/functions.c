@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -10,15 +11,24 @@
 #include <dirent.h>
 #include <limits.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <time.h>
 #include <fcntl.h>
 
+#ifdef __linux__
+#include <linux/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
 #include <JavaScriptCore/JavaScript.h>
 
 #include "bundle.h"
 #include "globals.h"
+#include "event_loop.h"
 #include "io.h"
+#include "io_pool.h"
 #include "jsc_utils.h"
 #include "str.h"
 #include "archive.h"
@@ -29,6 +39,14 @@
 #include "clock.h"
 #include "sockets.h"
 #include "tasks.h"
+#include "snapshot.h"
+#include "prefetch.h"
+#include "strmap.h"
+#include "cache_store.h"
+#include "classpath.h"
+#include "output.h"
+#include "walk.h"
+#include "worker.h"
 
 JSValueRef make_error_with_errno(JSContextRef ctx) {
     JSValueRef arguments[1];
@@ -75,6 +93,20 @@ JSValueRef function_console_stderr(JSContextRef ctx, JSObjectRef function, JSObj
     return JSValueMakeUndefined(ctx);
 }
 
+static void decode_contents_view(const char *contents, size_t length, void *data) {
+    *(JSStringRef *) data = utf8_to_string(contents, length);
+}
+
+// Decodes the UTF-8 contents of view, returning NULL if the file was truncated
+// while being read
+static JSStringRef contents_view_to_string(const contents_view_t *view) {
+    JSStringRef string = NULL;
+    if (with_contents_view(view, decode_contents_view, &string) < 0) {
+        return NULL;
+    }
+    return string;
+}
+
 JSValueRef function_read_file(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                               size_t argc, const JSValueRef args[], JSValueRef *exception) {
     // TODO: implement fully
@@ -89,10 +121,13 @@ JSValueRef function_read_file(JSContextRef ctx, JSObjectRef function, JSObjectRe
         // debug_print_value("read_file", ctx, args[0]);
 
         time_t last_modified = 0;
-        char *contents = get_contents(path, &last_modified);
-        if (contents != NULL) {
-            JSStringRef contents_str = JSStringCreateWithUTF8CString(contents);
-            free(contents);
+        contents_view_t view;
+        if (get_contents_view(path, &last_modified, &view) == 0) {
+            JSStringRef contents_str = contents_view_to_string(&view);
+            release_contents_view(&view);
+            if (contents_str == NULL) {
+                return JSValueMakeNull(ctx);
+            }
 
             JSValueRef res[2];
             res[0] = JSValueMakeString(ctx, contents_str);
@@ -104,6 +139,14 @@ JSValueRef function_read_file(JSContextRef ctx, JSObjectRef function, JSObjectRe
     return JSValueMakeNull(ctx);
 }
 
+// Whether Planck is running against its own ClojureScript sources, which are
+// then loaded in preference to the bundled copies
+static bool is_developing() {
+    return config.num_src_paths == 1 &&
+           strcmp(config.src_paths[0].type, "src") == 0 &&
+           str_has_suffix(config.src_paths[0].path, "/planck-cljs/src/") == 0;
+}
+
 JSValueRef function_load(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                          size_t argc, const JSValueRef args[], JSValueRef *exception) {
     // TODO: implement fully
@@ -119,22 +162,36 @@ JSValueRef function_load(JSContextRef ctx, JSObjectRef function, JSObjectRef thi
 
         time_t last_modified = 0;
         char *contents = NULL;
+        // Contents owned by the bundle or by file_view
+        const char *bundled = NULL;
+        contents_view_t file_view = {NULL, 0, 0};
         char *loaded_path = strdup(path);
         char *loaded_type = NULL;
         char *loaded_location = NULL;
 
-        bool developing = (config.num_src_paths == 1 &&
-                           strcmp(config.src_paths[0].type, "src") == 0 &&
-                           str_has_suffix(config.src_paths[0].path, "/planck-cljs/src/") == 0);
+        bool developing = is_developing();
 
         if (!developing) {
-            contents = bundle_get_contents(path);
+            contents = snapshot_get_resource(path);
+            if (contents == NULL) {
+                bundled = bundle_get_view(path, NULL);
+                if (bundled == NULL) {
+                    contents = bundle_get_contents(path);
+                    bundled = contents;
+                }
+                if (bundled != NULL) {
+                    snapshot_record_resource(path, bundled);
+                }
+            }
             loaded_type = "bundled";
             last_modified = 0;
         }
 
-        // load from classpath
-        if (contents == NULL) {
+        // load from classpath, probing the source directories ahead of the
+        // first JAR containing the path
+        if (contents == NULL && bundled == NULL) {
+            int64_t entry_index = -1;
+            int jar = classpath_find_jar(path, &entry_index);
             int i;
             for (i = 0; i < config.num_src_paths; i++) {
                 if (config.src_paths[i].blacklisted) {
@@ -146,68 +203,61 @@ JSValueRef function_load(JSContextRef ctx, JSObjectRef function, JSObjectRef thi
 
                 if (strcmp(type, "src") == 0) {
                     char *full_path = str_concat(location, path);
-                    contents = get_contents(full_path, &last_modified);
-                    if (contents != NULL) {
+                    if (get_contents_view(full_path, &last_modified, &file_view) == 0) {
+                        bundled = file_view.contents;
                         free(loaded_path);
                         loaded_path = strdup(full_path);
                         loaded_type = type;
                         loaded_location = location;
                     }
                     free(full_path);
-                } else if (strcmp(type, "jar") == 0) {
-                    struct stat file_stat;
-                    if (stat(location, &file_stat) == 0) {
-                        char *error_msg = NULL;
-                        if (!config.src_paths[i].archive) {
-                            config.src_paths[i].archive = open_archive(location, &error_msg);
-                            if (error_msg) {
-                                engine_print(error_msg);
-                                engine_print("\n");
-                                free(error_msg);
-                            }
-                        }
-                        if (config.src_paths[i].archive) {
-                            contents_zip_t contents_zip;
-                            contents_zip = get_contents_zip(config.src_paths[i].archive, path,
-                                                            &last_modified, &error_msg);
-                            contents = (char *) contents_zip.payload;
-                            if (!contents && error_msg) {
-                                engine_print(error_msg);
-                                engine_print("\n");
-                                free(error_msg);
-                            }
-                        }
-                        loaded_type = type;
-                        loaded_location = location;
-                    } else {
-                        engine_perror(location);
-                        config.src_paths[i].blacklisted = true;
+                } else if (i == jar) {
+                    char *error_msg = NULL;
+                    contents_zip_t contents_zip;
+                    contents_zip = get_contents_zip_index(config.src_paths[i].archive, entry_index,
+                                                          &last_modified, &error_msg);
+                    contents = (char *) contents_zip.payload;
+                    if (!contents && error_msg) {
+                        engine_print(error_msg);
+                        engine_print("\n");
+                        free(error_msg);
                     }
+                    loaded_type = type;
+                    loaded_location = location;
                 }
 
-                if (contents != NULL) {
+                if (contents != NULL || bundled != NULL || i == jar) {
                     break;
                 }
             }
         }
 
         // load from out/
-        if (contents == NULL) {
+        if (contents == NULL && bundled == NULL) {
             if (config.out_path != NULL) {
                 char *full_path = str_concat(config.out_path, path);
-                contents = get_contents(full_path, &last_modified);
+                if (get_contents_view(full_path, &last_modified, &file_view) == 0) {
+                    bundled = file_view.contents;
+                }
                 free(full_path);
             }
         }
 
-        if (developing && contents == NULL) {
+        if (developing && contents == NULL && bundled == NULL) {
             contents = bundle_get_contents(path);
             last_modified = 0;
         }
 
-        if (contents != NULL) {
-            JSStringRef contents_str = JSStringCreateWithUTF8CString(contents);
+        JSStringRef contents_str = NULL;
+        if (file_view.contents != NULL) {
+            contents_str = contents_view_to_string(&file_view);
+            release_contents_view(&file_view);
+        } else if (contents != NULL || bundled != NULL) {
+            contents_str = JSStringCreateWithUTF8CString(contents != NULL ? contents : bundled);
             free(contents);
+        }
+
+        if (contents_str != NULL) {
             JSStringRef loaded_path_str = JSStringCreateWithUTF8CString(loaded_path);
             free(loaded_path);
             JSStringRef loaded_type_str = JSStringCreateWithUTF8CString(loaded_type);
@@ -456,6 +506,123 @@ JSValueRef function_cache(JSContextRef ctx, JSObjectRef function, JSObjectRef th
     return JSValueMakeNull(ctx);
 }
 
+JSValueRef function_cache_put(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                              size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc >= 3 && argc % 2 == 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+        size_t count = (argc - 1) / 2;
+        const char **keys = calloc(count, sizeof(char *));
+        const char **data = calloc(count, sizeof(char *));
+
+        char *dir = value_to_c_string(ctx, args[0]);
+        size_t i;
+        for (i = 0; i < count; i++) {
+            keys[i] = value_to_c_string(ctx, args[1 + 2 * i]);
+            data[i] = value_to_c_string(ctx, args[2 + 2 * i]);
+        }
+
+        if (cache_store_put(dir, count, keys, data) < 0) {
+            *exception = make_error_with_errno(ctx);
+        }
+
+        for (i = 0; i < count; i++) {
+            free((char *) keys[i]);
+            free((char *) data[i]);
+        }
+        free(keys);
+        free(data);
+        free(dir);
+    }
+
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_cache_get(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                              size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 2 &&
+        JSValueGetType(ctx, args[0]) == kJSTypeString &&
+        JSValueGetType(ctx, args[1]) == kJSTypeString) {
+        char *dir = value_to_c_string(ctx, args[0]);
+        char *key = value_to_c_string(ctx, args[1]);
+
+        const char *contents = cache_store_get(dir, key, NULL);
+        JSValueRef rv = contents != NULL ? c_string_to_value(ctx, contents) : JSValueMakeNull(ctx);
+
+        free(dir);
+        free(key);
+        return rv;
+    }
+
+    return JSValueMakeNull(ctx);
+}
+
+// Held while the manifest is read, merged and rewritten, so that engines
+// writing at the same time don't lose each other's entries
+static pthread_mutex_t cache_manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+
+JSValueRef function_write_cache_manifest(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                         size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 2 &&
+        JSValueGetType(ctx, args[0]) == kJSTypeString &&
+        JSValueIsObject(ctx, args[1]) &&
+        JSObjectIsFunction(ctx, (JSObjectRef) args[1])) {
+
+        char *path = value_to_c_string(ctx, args[0]);
+
+        pthread_mutex_lock(&cache_manifest_lock);
+
+        // Other processes sharing the cache directory are kept out by a lock
+        // on a file beside the manifest, where the filesystem supports it
+        char *lock_path = str_concat(path, ".lock");
+        int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lock_fd != -1) {
+            flock(lock_fd, LOCK_EX);
+        }
+        free(lock_path);
+
+        // The function merges the pending entries into the manifest on disk
+        char *current = get_contents(path, NULL);
+        JSValueRef current_val = current != NULL ? c_string_to_value(ctx, current) : JSValueMakeNull(ctx);
+        free(current);
+        JSValueRef ex = NULL;
+        JSValueRef manifest_val = JSObjectCallAsFunction(ctx, (JSObjectRef) args[1], NULL, 1, &current_val, &ex);
+
+        if (ex != NULL) {
+            *exception = ex;
+        } else if (JSValueGetType(ctx, manifest_val) == kJSTypeString) {
+            char *manifest = value_to_c_string(ctx, manifest_val);
+
+            // Write a temporary file and rename it over the manifest, so that
+            // concurrent readers never see a partially written manifest
+            char *tmp_path = malloc(strlen(path) + 32);
+            sprintf(tmp_path, "%s.%ld.tmp", path, (long) getpid());
+
+            FILE *f = fopen(tmp_path, "w");
+            bool failed = f == NULL;
+            if (!failed) {
+                size_t len = strlen(manifest);
+                failed = fwrite(manifest, 1, len, f) != len;
+                failed = fclose(f) != 0 || failed;
+            }
+            if (failed || rename(tmp_path, path) != 0) {
+                *exception = make_error_with_errno(ctx);
+                unlink(tmp_path);
+            }
+
+            free(tmp_path);
+            free(manifest);
+        }
+
+        if (lock_fd != -1) {
+            close(lock_fd);
+        }
+        pthread_mutex_unlock(&cache_manifest_lock);
+
+        free(path);
+    }
+
+    return JSValueMakeNull(ctx);
+}
+
 JSValueRef function_eval(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                          size_t argc, const JSValueRef args[], JSValueRef *exception) {
     JSValueRef val = NULL;
@@ -502,12 +669,7 @@ JSValueRef function_print_fn(JSContextRef ctx, JSObjectRef function, JSObjectRef
     }
 
     if (argc == 1) {
-        char *str = value_to_c_string_ext(ctx, args[0], true);
-
-        fprintf(stdout, "%s", str);
-        fflush(stdout);
-
-        free(str);
+        output_print(stdout, ctx, args[0]);
     }
 
     return JSValueMakeNull(ctx);
@@ -523,12 +685,7 @@ JSValueRef function_print_err_fn(JSContextRef ctx, JSObjectRef function, JSObjec
     }
 
     if (argc == 1) {
-        char *str = value_to_c_string_ext(ctx, args[0], true);
-
-        fprintf(stderr, "%s", str);
-        fflush(stderr);
-
-        free(str);
+        output_print(stderr, ctx, args[0]);
     }
 
     return JSValueMakeNull(ctx);
@@ -543,25 +700,48 @@ JSValueRef function_exit_with_value(JSContextRef ctx, JSObjectRef function, JSOb
     return JSValueMakeNull(ctx);
 }
 
-JSValueRef function_raw_read_stdin(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
-                                   size_t argc, const JSValueRef args[], JSValueRef *exception) {
-    char buf[1024 + 1];
+#define STDIN_BUFFER_SIZE (64 * 1024)
 
-    size_t n = fread(buf, 1, config.is_tty ? 1 : 1024, stdin);
-    if (n > 0) {
-        buf[n] = '\0';
-        return c_string_to_value(ctx, buf);
+static descriptor_t stdin_descriptor() {
+    // Show any prompt before waiting for input
+    if (config.is_tty) {
+        output_flush();
     }
 
-    return JSValueMakeNull(ctx);
+    static descriptor_t descriptor = 0;
+    if (descriptor == 0) {
+        if (config.repl) {
+            // Share the stdio stream that the REPL reads its input from, with
+            // getline or linenoise, so neither reader swallows input the other
+            // has buffered
+            descriptor = ufile_open_stdin(config.is_tty ? 1 : 1024);
+        } else {
+            descriptor = ufile_open_fd(STDIN_FILENO, "UTF-8", STDIN_BUFFER_SIZE);
+        }
+    }
+    return descriptor;
+}
+
+static JSValueRef string_or_null(JSContextRef ctx, JSStringRef s) {
+    if (s == NULL) {
+        return JSValueMakeNull(ctx);
+    }
+    JSValueRef rv = JSValueMakeString(ctx, s);
+    JSStringRelease(s);
+    return rv;
+}
+
+JSValueRef function_raw_read_stdin(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                   size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    return string_or_null(ctx, ufile_read(stdin_descriptor()));
 }
 
 JSValueRef function_raw_write_stdout(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                      size_t argc, const JSValueRef args[], JSValueRef *exception) {
     if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
-        char *s = value_to_c_string(ctx, args[0]);
-        fprintf(stdout, "%s", s);
-        free(s);
+        JSStringRef s = JSValueToStringCopy(ctx, args[0], NULL);
+        output_write(stdout, s);
+        JSStringRelease(s);
     }
 
     return JSValueMakeNull(ctx);
@@ -569,7 +749,7 @@ JSValueRef function_raw_write_stdout(JSContextRef ctx, JSObjectRef function, JSO
 
 JSValueRef function_raw_flush_stdout(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                      size_t argc, const JSValueRef args[], JSValueRef *exception) {
-    fflush(stdout);
+    output_flush();
 
     return JSValueMakeNull(ctx);
 }
@@ -577,9 +757,9 @@ JSValueRef function_raw_flush_stdout(JSContextRef ctx, JSObjectRef function, JSO
 JSValueRef function_raw_write_stderr(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                      size_t argc, const JSValueRef args[], JSValueRef *exception) {
     if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
-        char *s = value_to_c_string(ctx, args[0]);
-        fprintf(stderr, "%s", s);
-        free(s);
+        JSStringRef s = JSValueToStringCopy(ctx, args[0], NULL);
+        output_write(stderr, s);
+        JSStringRelease(s);
     }
 
     return JSValueMakeNull(ctx);
@@ -592,33 +772,24 @@ JSValueRef function_raw_flush_stderr(JSContextRef ctx, JSObjectRef function, JSO
     return JSValueMakeNull(ctx);
 }
 
-unsigned long hash(unsigned char *str) {
-    unsigned long hash = 5381;
-    int c;
+// The goog/ scripts imported so far, keyed by path
+static strmap_t *loaded_goog_scripts = NULL;
 
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+static struct {
+    unsigned long import_requests;
+    unsigned long import_hits;
+    unsigned long import_misses;
+} runtime_stats;
 
-    return hash;
-}
-
-static unsigned long loaded_goog_hashes[2048];
-static size_t count_loaded_goog_hashes = 0;
-
-bool is_loaded(unsigned long h) {
-    size_t i;
-    for (i = 0; i < count_loaded_goog_hashes; ++i) {
-        if (loaded_goog_hashes[i] == h) {
-            return true;
-        }
-    }
-    return false;
+bool is_loaded(const char *path) {
+    return loaded_goog_scripts != NULL && strmap_contains(loaded_goog_scripts, path);
 }
 
-void add_loaded_hash(unsigned long h) {
-    if (count_loaded_goog_hashes < 2048) {
-        loaded_goog_hashes[count_loaded_goog_hashes++] = h;
+void add_loaded(const char *path) {
+    if (loaded_goog_scripts == NULL) {
+        loaded_goog_scripts = strmap_create(2048);
     }
+    strmap_put(loaded_goog_scripts, strdup(path), NULL);
 }
 
 JSValueRef function_import_script(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
@@ -636,26 +807,54 @@ JSValueRef function_import_script(JSContextRef ctx, JSObjectRef function, JSObje
         if (str_has_prefix(path, "goog/../") == 0) {
             path = path + 8;
         } else {
-            unsigned long h = hash((unsigned char *) path);
-            if (is_loaded(h)) {
+            runtime_stats.import_requests++;
+            if (is_loaded(path)) {
+                runtime_stats.import_hits++;
                 can_skip_load = true;
             } else {
-                add_loaded_hash(h);
+                runtime_stats.import_misses++;
+                add_loaded(path);
             }
         }
 
+        if (!can_skip_load && snapshot_claim_preloaded(path)) {
+            can_skip_load = true;
+        }
+
         if (!can_skip_load) {
             char *source = NULL;
+            const char *script = NULL;
+            contents_view_t file_view = {NULL, 0, 0};
             if (config.out_path == NULL) {
-                source = bundle_get_contents(path);
+                source = snapshot_get_script(path);
+                if (source == NULL && (script = bundle_get_view(path, NULL)) == NULL) {
+                    source = prefetch_take(path);
+                    if (source == NULL) {
+                        source = bundle_get_contents(path);
+                    }
+                }
             } else {
                 char *full_path = str_concat(config.out_path, path);
-                source = get_contents(full_path, NULL);
+                if (get_contents_view(full_path, NULL, &file_view) == 0) {
+                    script = file_view.contents;
+                }
                 free(full_path);
             }
-
             if (source != NULL) {
-                evaluate_script(ctx, source, path);
+                script = source;
+            }
+
+            if (file_view.contents != NULL) {
+                JSStringRef script_str = contents_view_to_string(&file_view);
+                release_contents_view(&file_view);
+                if (script_str != NULL) {
+                    evaluate_script_string(ctx, script_str, path);
+                    JSStringRelease(script_str);
+                    display_launch_timing(path);
+                }
+            } else if (script != NULL) {
+                snapshot_record_script(path, script);
+                evaluate_script(ctx, script, path);
                 display_launch_timing(path);
                 free(source);
             }
@@ -665,6 +864,42 @@ JSValueRef function_import_script(JSContextRef ctx, JSObjectRef function, JSObje
     return JSValueMakeUndefined(ctx);
 }
 
+static void set_stat(JSContextRef ctx, JSObjectRef result, const char *name, double value) {
+    JSStringRef name_str = JSStringCreateWithUTF8CString(name);
+    JSObjectSetProperty(ctx, result, name_str, JSValueMakeNumber(ctx, value), kJSPropertyAttributeNone, NULL);
+    JSStringRelease(name_str);
+}
+
+JSValueRef function_runtime_stats(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                  size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    JSObjectRef result = JSObjectMake(ctx, NULL, NULL);
+
+    set_stat(ctx, result, "import-requests", (double) runtime_stats.import_requests);
+    set_stat(ctx, result, "import-hits", (double) runtime_stats.import_hits);
+    set_stat(ctx, result, "import-misses", (double) runtime_stats.import_misses);
+    set_stat(ctx, result, "loaded-scripts",
+             (double) (loaded_goog_scripts != NULL ? strmap_count(loaded_goog_scripts) : 0));
+
+    return result;
+}
+
+JSValueRef function_bundle_exists(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                  size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+        char path[PATH_MAX];
+        JSStringRef path_str = JSValueToStringCopy(ctx, args[0], NULL);
+        assert(JSStringGetLength(path_str) < PATH_MAX);
+        JSStringGetUTF8CString(path_str, path, PATH_MAX);
+        JSStringRelease(path_str);
+
+        // When developing, PLANCK_LOAD prefers source files to the bundle,
+        // so report nothing bundled and let callers go by what it finds
+        return JSValueMakeBoolean(ctx, !is_developing() && bundle_exists(path));
+    }
+
+    return JSValueMakeBoolean(ctx, false);
+}
+
 descriptor_t descriptor_str_to_int(const char *s) {
     return (descriptor_t) atoll(s);
 }
@@ -677,13 +912,21 @@ char *descriptor_int_to_str(descriptor_t i) {
 
 JSValueRef function_file_reader_open(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                      size_t argc, const JSValueRef args[], JSValueRef *exception) {
-    if (argc == 2
+    if ((argc == 2 || argc == 3)
         && JSValueGetType(ctx, args[0]) == kJSTypeString) {
 
         char *path = value_to_c_string(ctx, args[0]);
         char *encoding = value_to_c_string(ctx, args[1]);
 
-        descriptor_t descriptor = ufile_open_read(path, encoding);
+        size_t buffer_size = 0;
+        if (argc == 3 && JSValueIsNumber(ctx, args[2])) {
+            double n = JSValueToNumber(ctx, args[2], NULL);
+            if (n >= 1) {
+                buffer_size = (size_t) n;
+            }
+        }
+
+        descriptor_t descriptor = ufile_open_read(path, encoding, buffer_size);
 
         free(path);
         free(encoding);
@@ -710,12 +953,7 @@ JSValueRef function_file_reader_read(JSContextRef ctx, JSObjectRef function, JSO
         free(descriptor);
 
         JSValueRef arguments[2];
-        if (result != NULL) {
-            arguments[0] = JSValueMakeString(ctx, result);
-            JSStringRelease(result);
-        } else {
-            arguments[0] = JSValueMakeNull(ctx);
-        }
+        arguments[0] = string_or_null(ctx, result);
         arguments[1] = JSValueMakeNull(ctx);
         return JSObjectMakeArray(ctx, 2, arguments, NULL);
     }
@@ -729,12 +967,55 @@ JSValueRef function_file_reader_close(JSContextRef ctx, JSObjectRef function, JS
         && JSValueGetType(ctx, args[0]) == kJSTypeString) {
 
         char *descriptor = value_to_c_string(ctx, args[0]);
-        ufile_close(descriptor_str_to_int(descriptor));
+        ufile_close_read(descriptor_str_to_int(descriptor));
         free(descriptor);
     }
     return JSValueMakeNull(ctx);
 }
 
+#define MAX_LINES_PER_READ 65536
+
+JSValueRef function_read_lines(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                               size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 2
+        && (JSValueIsNull(ctx, args[0]) || JSValueGetType(ctx, args[0]) == kJSTypeString)
+        && JSValueIsNumber(ctx, args[1])) {
+
+        // A null descriptor reads from standard input
+        descriptor_t descriptor;
+        if (JSValueIsNull(ctx, args[0])) {
+            descriptor = stdin_descriptor();
+        } else {
+            char *descriptor_str = value_to_c_string(ctx, args[0]);
+            descriptor = descriptor_str_to_int(descriptor_str);
+            free(descriptor_str);
+        }
+
+        double n = JSValueToNumber(ctx, args[1], NULL);
+        size_t max_lines = n < 1 ? 1 : n > MAX_LINES_PER_READ ? MAX_LINES_PER_READ : (size_t) n;
+
+        JSStringRef *lines = malloc(max_lines * sizeof(JSStringRef));
+        size_t count = ufile_read_lines(descriptor, max_lines, lines);
+        if (count == 0) {
+            free(lines);
+            return JSValueMakeNull(ctx);
+        }
+
+        JSValueRef *values = malloc(count * sizeof(JSValueRef));
+        size_t i;
+        for (i = 0; i < count; i++) {
+            values[i] = JSValueMakeString(ctx, lines[i]);
+            JSStringRelease(lines[i]);
+        }
+        JSObjectRef rv = JSObjectMakeArray(ctx, count, values, NULL);
+        free(values);
+        free(lines);
+        return rv;
+    }
+
+    return JSValueMakeNull(ctx);
+}
+
 JSValueRef function_file_writer_open(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                      size_t argc, const JSValueRef args[], JSValueRef *exception) {
     if (argc == 3
@@ -823,42 +1104,63 @@ JSValueRef function_file_input_stream_open(JSContextRef ctx, JSObjectRef functio
     return JSValueMakeNull(ctx);
 }
 
+#ifndef JAVASCRIPT_CORE_3
+static void free_typed_array_bytes(void *bytes, void *deallocator_context) {
+    free(bytes);
+}
+#endif
+
 JSValueRef function_file_input_stream_read(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                            size_t argc, const JSValueRef args[], JSValueRef *exception) {
-
-    static JSValueRef *charmap = NULL;
-    if (!charmap) {
-        charmap = malloc(256 * sizeof (JSValueRef));
-        int i;
-        for (i = 0; i < 256; i++) {
-            charmap[i] = JSValueMakeNumber(ctx, i);
-            JSValueProtect(ctx, charmap[i]);
-        }
-    }
-
-    if (argc == 1
+    if (argc >= 1 && argc <= 3
         && JSValueGetType(ctx, args[0]) == kJSTypeString) {
 
-        char *descriptor = value_to_c_string(ctx, args[0]);
-
         size_t buf_size = 4096;
+        if (argc >= 2 && JSValueIsNumber(ctx, args[1])) {
+            double n = JSValueToNumber(ctx, args[1], NULL);
+            if (n >= 1) {
+                buf_size = (size_t) n;
+            }
+        }
+
         uint8_t *buf = malloc(buf_size * sizeof(uint8_t));
+        if (!buf) {
+            *exception = make_error_with_errno(ctx);
+            return JSValueMakeNull(ctx);
+        }
 
+        char *descriptor = value_to_c_string(ctx, args[0]);
         size_t read = file_read(descriptor_str_to_int(descriptor), buf_size, buf);
-
         free(descriptor);
 
         if (read) {
             // TODO distinguish between eof and error down in fread call and throw if errro
-            JSValueRef arguments[read];
-            int num_arguments = (int) read;
-            int i;
-            for (i = 0; i < num_arguments; i++) {
-                arguments[i] = charmap[buf[i]];
+#ifndef JAVASCRIPT_CORE_3
+            bool typed_array = argc == 3 && JSValueToBoolean(ctx, args[2]);
+            if (typed_array) {
+                // The array takes ownership of the buffer, so give back any unused part of it
+                if (read < buf_size) {
+                    uint8_t *shrunk = realloc(buf, read);
+                    buf = shrunk ? shrunk : buf;
+                }
+                return JSObjectMakeTypedArrayWithBytesNoCopy(ctx, kJSTypedArrayTypeUint8Array, buf, read,
+                                                             free_typed_array_bytes, NULL, exception);
+            }
+#endif
+
+            JSValueRef *arguments = malloc(read * sizeof(JSValueRef));
+            size_t i;
+            for (i = 0; i < read; i++) {
+                arguments[i] = JSValueMakeNumber(ctx, buf[i]);
             }
+            free(buf);
 
-            return JSObjectMakeArray(ctx, num_arguments, arguments, NULL);
+            JSObjectRef rv = JSObjectMakeArray(ctx, read, arguments, NULL);
+            free(arguments);
+            return rv;
         }
+
+        free(buf);
     }
 
     return JSValueMakeNull(ctx);
@@ -907,6 +1209,31 @@ JSValueRef function_file_output_stream_write(JSContextRef ctx, JSObjectRef funct
 
         char *descriptor = value_to_c_string(ctx, args[0]);
 
+#ifndef JAVASCRIPT_CORE_3
+        // Typed arrays and array buffers are written straight from their backing store
+        JSTypedArrayType type = JSValueGetTypedArrayType(ctx, args[1], NULL);
+        if (type != kJSTypedArrayTypeNone) {
+            JSObjectRef array = (JSObjectRef) args[1];
+            uint8_t *bytes;
+            size_t length;
+            if (type == kJSTypedArrayTypeArrayBuffer) {
+                bytes = JSObjectGetArrayBufferBytesPtr(ctx, array, NULL);
+                length = JSObjectGetArrayBufferByteLength(ctx, array, NULL);
+            } else {
+                // Views may start part way into their buffer
+                JSObjectRef buffer = JSObjectGetTypedArrayBuffer(ctx, array, NULL);
+                bytes = (uint8_t *) JSObjectGetArrayBufferBytesPtr(ctx, buffer, NULL)
+                        + JSObjectGetTypedArrayByteOffset(ctx, array, NULL);
+                length = JSObjectGetTypedArrayByteLength(ctx, array, NULL);
+            }
+            if (bytes != NULL && length > 0) {
+                file_write(descriptor_str_to_int(descriptor), length, bytes);
+            }
+            free(descriptor);
+            return JSValueMakeNull(ctx);
+        }
+#endif
+
         unsigned int count = (unsigned int) array_get_count(ctx, (JSObjectRef) args[1]);
 
         uint8_t* buf = malloc(sizeof(uint8_t) * count);
@@ -1010,53 +1337,237 @@ JSValueRef function_copy_file(JSContextRef ctx, JSObjectRef function, JSObjectRe
     return JSValueMakeNull(ctx);
 }
 
-JSValueRef function_list_files(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
-                               size_t argc, const JSValueRef args[], JSValueRef *exception) {
-    if (argc == 1
-        && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+JSValueRef function_copy_tree(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                              size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 2
+        && JSValueGetType(ctx, args[0]) == kJSTypeString
+        && JSValueGetType(ctx, args[1]) == kJSTypeString) {
 
-        char *path = value_to_c_string(ctx, args[0]);
+        char *src = value_to_c_string(ctx, args[0]);
+        char *dst = value_to_c_string(ctx, args[1]);
 
-        size_t capacity = 32;
-        size_t count = 0;
+        int rv = copy_tree(src, dst);
+        if (rv) {
+            *exception = make_error_with_errno(ctx);
+        }
 
-        JSValueRef *paths = malloc(capacity * sizeof(JSValueRef));
+        free(src);
+        free(dst);
+    }
+    return JSValueMakeNull(ctx);
+}
 
-        DIR *d = opendir(path);
+enum async_io_op {
+    ASYNC_IO_READ,
+    ASYNC_IO_WRITE,
+    ASYNC_IO_COPY
+};
+
+struct async_io {
+    enum async_io_op op;
+    unsigned long id;
+    char *path;
+    char *dst_path;
+    char *encoding;
+    bool append;
+    JSStringRef content;
+    JSChar *result;
+    size_t result_length;
+    int error;
+};
+
+static void free_async_io(struct async_io *async_io) {
+    free(async_io->path);
+    free(async_io->dst_path);
+    free(async_io->encoding);
+    if (async_io->content) {
+        JSStringRelease(async_io->content);
+    }
+    free(async_io->result);
+    free(async_io);
+}
 
-        if (d) {
-            size_t path_len = strlen(path);
-            if (path_len && path[path_len - 1] == '/') {
-                path[--path_len] = 0;
-            }
+// Calls back into JavaScript with the outcome of the operation, on the event
+// loop
+static void complete_async_io(void *data) {
+    struct async_io *async_io = data;
+
+    JSValueRef args[3];
+    args[0] = JSValueMakeNumber(ctx, (double) async_io->id);
+    args[1] = JSValueMakeNull(ctx);
+    args[2] = JSValueMakeNull(ctx);
+    if (async_io->error) {
+        args[2] = c_string_to_value(ctx, strerror(async_io->error));
+    } else if (async_io->op == ASYNC_IO_READ) {
+        JSStringRef contents = JSStringCreateWithCharacters(async_io->result, async_io->result_length);
+        args[1] = JSValueMakeString(ctx, contents);
+        JSStringRelease(contents);
+    }
 
-            struct dirent *dir;
-            while ((dir = readdir(d)) != NULL) {
-                if (strcmp(dir->d_name, ".") && strcmp(dir->d_name, "..")) {
+    static JSObjectRef run_async_io_fn = NULL;
+    if (!run_async_io_fn) {
+        run_async_io_fn = get_function("global", "PLANCK_RUN_ASYNC_IO");
+        JSValueProtect(ctx, run_async_io_fn);
+    }
+    JSObjectCallAsFunction(ctx, run_async_io_fn, NULL, 3, args, NULL);
 
-                    size_t buf_len = path_len + strlen(dir->d_name) + 2;
-                    char *buf = malloc(buf_len);
-                    snprintf(buf, buf_len, "%s/%s", path, dir->d_name);
-                    JSValueRef path_ref = c_string_to_value(ctx, buf);
-                    paths[count++] = path_ref;
-                    JSValueProtect(ctx, path_ref);
-                    free(buf);
+    free_async_io(async_io);
 
-                    if (count == capacity) {
-                        capacity *= 2;
-                        paths = realloc(paths, capacity * sizeof(JSValueRef));
-                    }
-                }
-            }
+    int err = signal_task_complete();
+    if (err) {
+        engine_print_err_message("signal_task_complete", err);
+    }
+}
 
-            closedir(d);
-        }
+static void do_async_io(void *data) {
+    struct async_io *async_io = data;
+
+    int rv = 0;
+    switch (async_io->op) {
+        case ASYNC_IO_READ:
+            rv = ufile_read_all(async_io->path, async_io->encoding, &async_io->result, &async_io->result_length);
+            break;
+        case ASYNC_IO_WRITE:
+            rv = ufile_write_all(async_io->path, async_io->append, async_io->encoding,
+                                 JSStringGetCharactersPtr(async_io->content),
+                                 JSStringGetLength(async_io->content));
+            break;
+        case ASYNC_IO_COPY:
+            rv = copy_tree(async_io->path, async_io->dst_path);
+            break;
+    }
+    if (rv) {
+        async_io->error = errno ? errno : EIO;
+    }
 
-        JSValueRef rv = JSObjectMakeArray(ctx, count, paths, NULL);
+    event_loop_post(complete_async_io, async_io);
+}
 
-        size_t i = 0;
-        for (i=0; i<count; ++i) {
-            JSValueUnprotect(ctx, paths[i]);
+static void submit_async_io(struct async_io *async_io) {
+    int err = signal_task_started();
+    if (err) {
+        engine_print_err_message("signal_task_started", err);
+    }
+
+    err = io_pool_submit(do_async_io, async_io);
+    if (err) {
+        // Still report the failure asynchronously, once the caller has returned
+        async_io->error = err;
+        event_loop_post(complete_async_io, async_io);
+    }
+}
+
+static struct async_io *make_async_io(JSContextRef ctx, enum async_io_op op, JSValueRef id) {
+    struct async_io *async_io = calloc(1, sizeof(struct async_io));
+    async_io->op = op;
+    async_io->id = (unsigned long) JSValueToNumber(ctx, id, NULL);
+    return async_io;
+}
+
+JSValueRef function_read_async(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                               size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 3
+        && JSValueGetType(ctx, args[0]) == kJSTypeString
+        && JSValueGetType(ctx, args[1]) == kJSTypeString
+        && JSValueGetType(ctx, args[2]) == kJSTypeNumber) {
+
+        struct async_io *async_io = make_async_io(ctx, ASYNC_IO_READ, args[2]);
+        async_io->path = value_to_c_string(ctx, args[0]);
+        async_io->encoding = value_to_c_string(ctx, args[1]);
+        submit_async_io(async_io);
+    } else {
+        errno = EINVAL;
+        *exception = make_error_with_errno(ctx);
+    }
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_write_async(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 5
+        && JSValueGetType(ctx, args[0]) == kJSTypeString
+        && JSValueGetType(ctx, args[1]) == kJSTypeString
+        && JSValueGetType(ctx, args[3]) == kJSTypeString
+        && JSValueGetType(ctx, args[4]) == kJSTypeNumber) {
+
+        struct async_io *async_io = make_async_io(ctx, ASYNC_IO_WRITE, args[4]);
+        async_io->path = value_to_c_string(ctx, args[0]);
+        async_io->content = JSValueToStringCopy(ctx, args[1], NULL);
+        async_io->append = JSValueToBoolean(ctx, args[2]);
+        async_io->encoding = value_to_c_string(ctx, args[3]);
+        submit_async_io(async_io);
+    } else {
+        errno = EINVAL;
+        *exception = make_error_with_errno(ctx);
+    }
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_copy_async(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                               size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 3
+        && JSValueGetType(ctx, args[0]) == kJSTypeString
+        && JSValueGetType(ctx, args[1]) == kJSTypeString
+        && JSValueGetType(ctx, args[2]) == kJSTypeNumber) {
+
+        struct async_io *async_io = make_async_io(ctx, ASYNC_IO_COPY, args[2]);
+        async_io->path = value_to_c_string(ctx, args[0]);
+        async_io->dst_path = value_to_c_string(ctx, args[1]);
+        submit_async_io(async_io);
+    } else {
+        errno = EINVAL;
+        *exception = make_error_with_errno(ctx);
+    }
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_list_files(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                               size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1
+        && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+
+        char *path = value_to_c_string(ctx, args[0]);
+
+        size_t capacity = 32;
+        size_t count = 0;
+
+        JSValueRef *paths = malloc(capacity * sizeof(JSValueRef));
+
+        DIR *d = opendir(path);
+
+        if (d) {
+            size_t path_len = strlen(path);
+            if (path_len && path[path_len - 1] == '/') {
+                path[--path_len] = 0;
+            }
+
+            struct dirent *dir;
+            while ((dir = readdir(d)) != NULL) {
+                if (strcmp(dir->d_name, ".") && strcmp(dir->d_name, "..")) {
+
+                    size_t buf_len = path_len + strlen(dir->d_name) + 2;
+                    char *buf = malloc(buf_len);
+                    snprintf(buf, buf_len, "%s/%s", path, dir->d_name);
+                    JSValueRef path_ref = c_string_to_value(ctx, buf);
+                    paths[count++] = path_ref;
+                    JSValueProtect(ctx, path_ref);
+                    free(buf);
+
+                    if (count == capacity) {
+                        capacity *= 2;
+                        paths = realloc(paths, capacity * sizeof(JSValueRef));
+                    }
+                }
+            }
+
+            closedir(d);
+        }
+
+        JSValueRef rv = JSObjectMakeArray(ctx, count, paths, NULL);
+
+        size_t i = 0;
+        for (i=0; i<count; ++i) {
+            JSValueUnprotect(ctx, paths[i]);
         }
 
         free(path);
@@ -1067,6 +1578,98 @@ JSValueRef function_list_files(JSContextRef ctx, JSObjectRef function, JSObjectR
     return JSValueMakeNull(ctx);
 }
 
+JSValueRef function_walk_open(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                              size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if ((argc == 4 || argc == 6)
+        && JSValueGetType(ctx, args[0]) == kJSTypeString
+        && JSValueGetType(ctx, args[1]) == kJSTypeNumber) {
+
+        char *root = value_to_c_string(ctx, args[0]);
+        int max_depth = (int) JSValueToNumber(ctx, args[1], NULL);
+        char *glob = JSValueIsString(ctx, args[2]) ? value_to_c_string(ctx, args[2]) : NULL;
+        bool follow_links = JSValueToBoolean(ctx, args[3]);
+
+        // A number of threads (0 meaning one per CPU) or sorting asks for a
+        // parallel walk
+        bool parallel = argc == 6 && (JSValueIsNumber(ctx, args[4]) || JSValueToBoolean(ctx, args[5]));
+        walker_t *walker;
+        if (parallel) {
+            int num_threads = JSValueIsNumber(ctx, args[4]) ? (int) JSValueToNumber(ctx, args[4], NULL) : 1;
+            walker = walk_open_parallel(root, max_depth, glob, follow_links, num_threads, JSValueToBoolean(ctx, args[5]));
+        } else {
+            walker = walk_open(root, max_depth, glob, follow_links);
+        }
+
+        free(root);
+        free(glob);
+
+        char *descriptor_str = descriptor_int_to_str((descriptor_t) walker);
+        JSValueRef rv = c_string_to_value(ctx, descriptor_str);
+        free(descriptor_str);
+
+        return rv;
+    }
+    return JSValueMakeNull(ctx);
+}
+
+struct walk_batch {
+    JSContextRef ctx;
+    JSObjectRef array;
+    unsigned index;
+    // Made once per batch, as the calling context may belong to any engine
+    JSValueRef type_names[WALK_NUM_TYPES];
+};
+
+static void add_walk_entry(const char *path, walk_type_t type, void *data) {
+    struct walk_batch *batch = data;
+    JSContextRef ctx = batch->ctx;
+    if (!batch->type_names[type]) {
+        batch->type_names[type] = c_string_to_value(ctx, walk_type_name(type));
+    }
+
+    // Adding each value to the array as it is made keeps it reachable,
+    // without needing to protect it
+    JSObjectSetPropertyAtIndex(ctx, batch->array, batch->index++, c_string_to_value(ctx, path), NULL);
+    JSObjectSetPropertyAtIndex(ctx, batch->array, batch->index++, batch->type_names[type], NULL);
+}
+
+JSValueRef function_walk(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                         size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 2
+        && JSValueGetType(ctx, args[0]) == kJSTypeString
+        && JSValueGetType(ctx, args[1]) == kJSTypeNumber) {
+
+        char *descriptor = value_to_c_string(ctx, args[0]);
+        walker_t *walker = (walker_t *) descriptor_str_to_int(descriptor);
+        free(descriptor);
+
+        size_t max = (size_t) JSValueToNumber(ctx, args[1], NULL);
+
+        struct walk_batch batch;
+        memset(&batch, 0, sizeof(batch));
+        batch.ctx = ctx;
+        batch.array = JSObjectMakeArray(ctx, 0, NULL, NULL);
+        batch.index = 0;
+
+        if (walk_next(walker, max > 0 ? max : 1, add_walk_entry, &batch) > 0) {
+            return batch.array;
+        }
+    }
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_walk_close(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                               size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1
+        && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+
+        char *descriptor = value_to_c_string(ctx, args[0]);
+        walk_close((walker_t *) descriptor_str_to_int(descriptor));
+        free(descriptor);
+    }
+    return JSValueMakeNull(ctx);
+}
+
 JSValueRef function_mktemp(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                            size_t argc, const JSValueRef args[], JSValueRef *exception) {
     if (argc == 3
@@ -1141,110 +1744,395 @@ JSValueRef function_is_directory(JSContextRef ctx, JSObjectRef function, JSObjec
     return JSValueMakeNull(ctx);
 }
 
-JSValueRef function_fstat(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
-                          size_t argc, const JSValueRef args[], JSValueRef *exception) {
-    if (argc == 1
-        && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+enum file_attribute {
+    ATTR_TYPE,
+    ATTR_DEVICE_ID,
+    ATTR_FILE_NUMBER,
+    ATTR_PERMISSIONS,
+    ATTR_REFERENCE_COUNT,
+    ATTR_UID,
+    ATTR_UNAME,
+    ATTR_GID,
+    ATTR_GNAME,
+    ATTR_FILE_SIZE,
+    ATTR_CREATED,
+    ATTR_MODIFIED,
+    NUM_FILE_ATTRIBUTES
+};
+
+#define ALL_FILE_ATTRIBUTES ((1u << NUM_FILE_ATTRIBUTES) - 1)
+
+static const char *file_attribute_names[NUM_FILE_ATTRIBUTES] = {
+        "type",
+        "device-id",
+        "file-number",
+        "permissions",
+        "reference-count",
+        "uid",
+        "uname",
+        "gid",
+        "gname",
+        "file-size",
+        "created",
+        "modified"
+};
+
+// The attributes of a file, from whichever of stat or statx was used
+struct file_attributes {
+    mode_t mode;
+    double device_id;
+    double file_number;
+    double reference_count;
+    uid_t uid;
+    gid_t gid;
+    double file_size;
+    double created;
+    double modified;
+};
+
+#if defined(__linux__) && defined(__NR_statx) && defined(STATX_BASIC_STATS)
+#define PLANCK_USE_STATX 1
+
+static atomic_bool statx_unsupported = false;
+
+// Asks statx for only the fields that are wanted, which can spare network
+// filesystems from fetching the rest, returning -1 with errno set to ENOSYS
+// if statx isn't available. Seccomp filters that predate statx, as some
+// container runtimes use, reject it with EPERM, which counts as unavailable.
+static int statx_attributes(const char *path, unsigned wanted, struct file_attributes *attrs) {
+    if (statx_unsupported) {
+        errno = ENOSYS;
+        return -1;
+    }
 
-        char *path = value_to_c_string(ctx, args[0]);
+    unsigned mask = 0;
+    if (wanted & (1u << ATTR_TYPE | 1u << ATTR_PERMISSIONS)) mask |= STATX_TYPE | STATX_MODE;
+    if (wanted & 1u << ATTR_FILE_NUMBER) mask |= STATX_INO;
+    if (wanted & 1u << ATTR_REFERENCE_COUNT) mask |= STATX_NLINK;
+    if (wanted & (1u << ATTR_UID | 1u << ATTR_UNAME)) mask |= STATX_UID;
+    if (wanted & (1u << ATTR_GID | 1u << ATTR_GNAME)) mask |= STATX_GID;
+    if (wanted & 1u << ATTR_FILE_SIZE) mask |= STATX_SIZE;
+    if (wanted & 1u << ATTR_CREATED) mask |= STATX_BTIME | STATX_CTIME;
+    if (wanted & 1u << ATTR_MODIFIED) mask |= STATX_MTIME;
+
+    struct statx stx;
+    if (syscall(__NR_statx, AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, mask, &stx) < 0) {
+        if (errno == ENOSYS || errno == EPERM) {
+            statx_unsupported = true;
+            errno = ENOSYS;
+        }
+        return -1;
+    }
 
-        struct stat file_stat;
+    attrs->mode = stx.stx_mode;
+    attrs->device_id = (double) makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+    attrs->file_number = (double) stx.stx_ino;
+    attrs->reference_count = (double) stx.stx_nlink;
+    attrs->uid = stx.stx_uid;
+    attrs->gid = stx.stx_gid;
+    attrs->file_size = (double) stx.stx_size;
+    // As with stat, fall back to the time of the last status change where
+    // the filesystem doesn't record when a file was created
+    struct statx_timestamp created = (stx.stx_mask & STATX_BTIME) ? stx.stx_btime : stx.stx_ctime;
+    attrs->created = 1000.0 * created.tv_sec + created.tv_nsec / 1000000;
+    attrs->modified = 1000.0 * stx.stx_mtime.tv_sec + stx.stx_mtime.tv_nsec / 1000000;
+    return 0;
+}
+#endif
 
-        int retval = lstat(path, &file_stat);
+static double timespec_to_ms(struct timespec ts) {
+    return 1000.0 * ts.tv_sec + ts.tv_nsec / 1000000;
+}
 
-        if (retval == 0) {
-            JSObjectRef result = JSObjectMake(ctx, NULL, NULL);
-
-            char *type = "unknown";
-            if (S_ISDIR(file_stat.st_mode)) {
-                type = "directory";
-            } else if (S_ISREG(file_stat.st_mode)) {
-                type = "file";
-            } else if (S_ISLNK(file_stat.st_mode)) {
-                type = "symbolic-link";
-            } else if (S_ISSOCK(file_stat.st_mode)) {
-                type = "socket";
-            } else if (S_ISFIFO(file_stat.st_mode)) {
-                type = "fifo";
-            } else if (S_ISCHR(file_stat.st_mode)) {
-                type = "character-special";
-            } else if (S_ISBLK(file_stat.st_mode)) {
-                type = "block-special";
-            }
+static int get_file_attributes(const char *path, unsigned wanted, struct file_attributes *attrs) {
+#ifdef PLANCK_USE_STATX
+    if (statx_attributes(path, wanted, attrs) == 0) {
+        return 0;
+    } else if (errno != ENOSYS) {
+        return -1;
+    }
+#endif
+
+    struct stat file_stat;
+    if (lstat(path, &file_stat) < 0) {
+        return -1;
+    }
+
+#ifdef __APPLE__
+#define birthtime(x) x.st_birthtimespec
+#define mtime(x) x.st_mtimespec
+#else
+#define birthtime(x) x.st_ctim
+#define mtime(x) x.st_mtim
+#endif
 
-            JSObjectSetProperty(ctx, result, JSStringCreateWithUTF8CString("type"),
-                                c_string_to_value(ctx, type),
-                                kJSPropertyAttributeReadOnly, NULL);
+    attrs->mode = file_stat.st_mode;
+    attrs->device_id = (double) file_stat.st_rdev;
+    attrs->file_number = (double) file_stat.st_ino;
+    attrs->reference_count = (double) file_stat.st_nlink;
+    attrs->uid = file_stat.st_uid;
+    attrs->gid = file_stat.st_gid;
+    attrs->file_size = (double) file_stat.st_size;
+    attrs->created = timespec_to_ms(birthtime(file_stat));
+    attrs->modified = timespec_to_ms(mtime(file_stat));
+    return 0;
+}
 
+struct id_name {
+    unsigned id;
+    char *name;
+};
+
+struct id_names {
+    struct id_name *entries;
+    size_t count;
+    size_t capacity;
+};
+
+// The names are kept as C strings, shared by the engines of every thread,
+// and turned into values in the calling context as they are needed
+static pthread_mutex_t id_names_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct id_names user_names;
+static struct id_names group_names;
+
+// Looks up the name for a uid or gid, remembering it (or that there is none)
+static JSValueRef id_name(JSContextRef ctx, struct id_names *names, unsigned id, bool is_group) {
+    pthread_mutex_lock(&id_names_lock);
+
+    const char *name = NULL;
+    bool found = false;
+    size_t i;
+    for (i = 0; i < names->count && !found; i++) {
+        if (names->entries[i].id == id) {
+            name = names->entries[i].name;
+            found = true;
+        }
+    }
 
-            double device_id = (double) file_stat.st_rdev;
-            if (device_id) {
-                JSObjectSetProperty(ctx, result, JSStringCreateWithUTF8CString("device-id"),
-                                    JSValueMakeNumber(ctx, device_id),
-                                    kJSPropertyAttributeReadOnly, NULL);
+    if (!found) {
+        char buf[4096];
+        char *looked_up = NULL;
+        if (is_group) {
+            struct group gid_group;
+            struct group *result = NULL;
+            if (getgrgid_r((gid_t) id, &gid_group, buf, sizeof(buf), &result) == 0 && result) {
+                looked_up = strdup(result->gr_name);
             }
-
-            double file_number = (double) file_stat.st_ino;
-            if (file_number) {
-                JSObjectSetProperty(ctx, result, JSStringCreateWithUTF8CString("file-number"),
-                                    JSValueMakeNumber(ctx, file_number),
-                                    kJSPropertyAttributeReadOnly, NULL);
+        } else {
+            struct passwd uid_passwd;
+            struct passwd *result = NULL;
+            if (getpwuid_r((uid_t) id, &uid_passwd, buf, sizeof(buf), &result) == 0 && result) {
+                looked_up = strdup(result->pw_name);
             }
+        }
 
-            JSObjectSetProperty(ctx, result, JSStringCreateWithUTF8CString("permissions"),
-                                JSValueMakeNumber(ctx, (double) (ACCESSPERMS & file_stat.st_mode)),
-                                kJSPropertyAttributeReadOnly, NULL);
+        if (names->count == names->capacity) {
+            names->capacity = names->capacity ? names->capacity * 2 : 8;
+            names->entries = realloc(names->entries, names->capacity * sizeof(struct id_name));
+        }
+        names->entries[names->count].id = id;
+        names->entries[names->count].name = looked_up;
+        names->count++;
+        name = looked_up;
+    }
 
-            JSObjectSetProperty(ctx, result, JSStringCreateWithUTF8CString("reference-count"),
-                                JSValueMakeNumber(ctx, (double) file_stat.st_nlink),
-                                kJSPropertyAttributeReadOnly, NULL);
+    JSValueRef value = name ? c_string_to_value(ctx, name) : NULL;
+    pthread_mutex_unlock(&id_names_lock);
+    return value;
+}
 
-            JSObjectSetProperty(ctx, result, JSStringCreateWithUTF8CString("uid"),
-                                JSValueMakeNumber(ctx, (double) file_stat.st_uid),
-                                kJSPropertyAttributeReadOnly, NULL);
+static JSStringRef property_names[NUM_FILE_ATTRIBUTES];
 
-            struct passwd *uid_passwd = getpwuid(file_stat.st_uid);
+static pthread_once_t property_names_once = PTHREAD_ONCE_INIT;
 
-            if (uid_passwd) {
-                JSObjectSetProperty(ctx, result, JSStringCreateWithUTF8CString("uname"),
-                                    c_string_to_value(ctx, uid_passwd->pw_name),
-                                    kJSPropertyAttributeReadOnly, NULL);
-            }
+// Property names are plain strings rather than values, so can be shared
+// between contexts
+static void init_property_names() {
+    int i;
+    for (i = 0; i < NUM_FILE_ATTRIBUTES; i++) {
+        property_names[i] = JSStringCreateWithUTF8CString(file_attribute_names[i]);
+    }
+}
 
-            JSObjectSetProperty(ctx, result, JSStringCreateWithUTF8CString("gid"),
-                                JSValueMakeNumber(ctx, (double) file_stat.st_gid),
-                                kJSPropertyAttributeReadOnly, NULL);
+static void set_file_attribute(JSContextRef ctx, JSObjectRef result, enum file_attribute attribute,
+                               JSValueRef value) {
+    JSObjectSetProperty(ctx, result, property_names[attribute], value, kJSPropertyAttributeReadOnly, NULL);
+}
 
-            struct group *gid_group = getgrgid(file_stat.st_gid);
+// Values made in the calling context, reused for the files of a single call
+struct file_attribute_values {
+    JSValueRef type_names[WALK_NUM_TYPES];
+    uid_t uid;
+    JSValueRef uname;
+    gid_t gid;
+    JSValueRef gname;
+};
+
+// Makes an object with the wanted attributes of the file at path, or
+// returns NULL if it can't be stat'ed
+static JSObjectRef make_file_attributes(JSContextRef ctx, const char *path, unsigned wanted,
+                                        struct file_attribute_values *values) {
+    pthread_once(&property_names_once, init_property_names);
+
+    struct file_attributes attrs;
+    if (get_file_attributes(path, wanted, &attrs) < 0) {
+        return NULL;
+    }
 
-            if (gid_group) {
-                JSObjectSetProperty(ctx, result, JSStringCreateWithUTF8CString("gname"),
-                                    c_string_to_value(ctx, gid_group->gr_name),
-                                    kJSPropertyAttributeReadOnly, NULL);
-            }
+    JSObjectRef result = JSObjectMake(ctx, NULL, NULL);
+
+    if (wanted & 1u << ATTR_TYPE) {
+        walk_type_t type = WALK_UNKNOWN;
+        if (S_ISDIR(attrs.mode)) {
+            type = WALK_DIRECTORY;
+        } else if (S_ISREG(attrs.mode)) {
+            type = WALK_FILE;
+        } else if (S_ISLNK(attrs.mode)) {
+            type = WALK_SYMBOLIC_LINK;
+        } else if (S_ISSOCK(attrs.mode)) {
+            type = WALK_SOCKET;
+        } else if (S_ISFIFO(attrs.mode)) {
+            type = WALK_FIFO;
+        } else if (S_ISCHR(attrs.mode)) {
+            type = WALK_CHARACTER_SPECIAL;
+        } else if (S_ISBLK(attrs.mode)) {
+            type = WALK_BLOCK_SPECIAL;
+        }
+        if (!values->type_names[type]) {
+            values->type_names[type] = c_string_to_value(ctx, walk_type_name(type));
+        }
+        set_file_attribute(ctx, result, ATTR_TYPE, values->type_names[type]);
+    }
 
-            JSObjectSetProperty(ctx, result, JSStringCreateWithUTF8CString("file-size"),
-                                JSValueMakeNumber(ctx, (double) file_stat.st_size),
-                                kJSPropertyAttributeReadOnly, NULL);
+    if (wanted & 1u << ATTR_DEVICE_ID && attrs.device_id) {
+        set_file_attribute(ctx, result, ATTR_DEVICE_ID, JSValueMakeNumber(ctx, attrs.device_id));
+    }
 
-#ifdef __APPLE__
-#define birthtime(x) x.st_birthtime
-#else
-#define birthtime(x) x.st_ctime
-#endif
+    if (wanted & 1u << ATTR_FILE_NUMBER && attrs.file_number) {
+        set_file_attribute(ctx, result, ATTR_FILE_NUMBER, JSValueMakeNumber(ctx, attrs.file_number));
+    }
 
-            JSObjectSetProperty(ctx, result, JSStringCreateWithUTF8CString("created"),
-                                JSValueMakeNumber(ctx, 1000 * birthtime(file_stat)),
-                                kJSPropertyAttributeReadOnly, NULL);
+    if (wanted & 1u << ATTR_PERMISSIONS) {
+        set_file_attribute(ctx, result, ATTR_PERMISSIONS,
+                           JSValueMakeNumber(ctx, (double) (ACCESSPERMS & attrs.mode)));
+    }
 
-            JSObjectSetProperty(ctx, result, JSStringCreateWithUTF8CString("modified"),
-                                JSValueMakeNumber(ctx, 1000 * file_stat.st_mtime),
-                                kJSPropertyAttributeReadOnly, NULL);
+    if (wanted & 1u << ATTR_REFERENCE_COUNT) {
+        set_file_attribute(ctx, result, ATTR_REFERENCE_COUNT, JSValueMakeNumber(ctx, attrs.reference_count));
+    }
 
-            return result;
+    if (wanted & 1u << ATTR_UID) {
+        set_file_attribute(ctx, result, ATTR_UID, JSValueMakeNumber(ctx, (double) attrs.uid));
+    }
+
+    if (wanted & 1u << ATTR_UNAME) {
+        if (!values->uname || values->uid != attrs.uid) {
+            values->uid = attrs.uid;
+            values->uname = id_name(ctx, &user_names, (unsigned) attrs.uid, false);
+        }
+        JSValueRef name = values->uname;
+        if (name) {
+            set_file_attribute(ctx, result, ATTR_UNAME, name);
         }
+    }
+
+    if (wanted & 1u << ATTR_GID) {
+        set_file_attribute(ctx, result, ATTR_GID, JSValueMakeNumber(ctx, (double) attrs.gid));
+    }
+
+    if (wanted & 1u << ATTR_GNAME) {
+        if (!values->gname || values->gid != attrs.gid) {
+            values->gid = attrs.gid;
+            values->gname = id_name(ctx, &group_names, (unsigned) attrs.gid, true);
+        }
+        JSValueRef name = values->gname;
+        if (name) {
+            set_file_attribute(ctx, result, ATTR_GNAME, name);
+        }
+    }
+
+    if (wanted & 1u << ATTR_FILE_SIZE) {
+        set_file_attribute(ctx, result, ATTR_FILE_SIZE, JSValueMakeNumber(ctx, attrs.file_size));
+    }
 
+    if (wanted & 1u << ATTR_CREATED) {
+        set_file_attribute(ctx, result, ATTR_CREATED, JSValueMakeNumber(ctx, attrs.created));
+    }
+
+    if (wanted & 1u << ATTR_MODIFIED) {
+        set_file_attribute(ctx, result, ATTR_MODIFIED, JSValueMakeNumber(ctx, attrs.modified));
+    }
+
+    return result;
+}
+
+JSValueRef function_fstat(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                          size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1
+        && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+
+        char *path = value_to_c_string(ctx, args[0]);
+        struct file_attribute_values values;
+        memset(&values, 0, sizeof(values));
+        JSObjectRef result = make_file_attributes(ctx, path, ALL_FILE_ATTRIBUTES, &values);
         free(path);
+
+        if (result) {
+            return result;
+        }
+    }
+    return JSValueMakeNull(ctx);
+}
+
+static size_t array_length(JSContextRef ctx, JSObjectRef array) {
+    JSStringRef length_str = JSStringCreateWithUTF8CString("length");
+    size_t length = (size_t) JSValueToNumber(ctx, JSObjectGetProperty(ctx, array, length_str, NULL), NULL);
+    JSStringRelease(length_str);
+    return length;
+}
+
+JSValueRef function_fstat_many(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                               size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 2
+        && JSValueIsObject(ctx, args[0])) {
+
+        JSObjectRef paths = JSValueToObject(ctx, args[0], NULL);
+
+        // Either all of the attributes, or those named in the second argument
+        unsigned wanted = ALL_FILE_ATTRIBUTES;
+        if (JSValueIsObject(ctx, args[1])) {
+            JSObjectRef fields = JSValueToObject(ctx, args[1], NULL);
+            wanted = 0;
+            size_t num_fields = array_length(ctx, fields);
+            size_t i;
+            for (i = 0; i < num_fields; i++) {
+                char *field = value_to_c_string(ctx, JSObjectGetPropertyAtIndex(ctx, fields, (unsigned) i, NULL));
+                int j;
+                for (j = 0; field && j < NUM_FILE_ATTRIBUTES; j++) {
+                    if (strcmp(field, file_attribute_names[j]) == 0) {
+                        wanted |= 1u << j;
+                    }
+                }
+                free(field);
+            }
+        }
+
+        size_t num_paths = array_length(ctx, paths);
+        JSObjectRef results = JSObjectMakeArray(ctx, 0, NULL, NULL);
+        struct file_attribute_values values;
+        memset(&values, 0, sizeof(values));
+        size_t i;
+        for (i = 0; i < num_paths; i++) {
+            JSValueRef path_ref = JSObjectGetPropertyAtIndex(ctx, paths, (unsigned) i, NULL);
+            JSObjectRef result = NULL;
+            if (JSValueIsString(ctx, path_ref)) {
+                char *path = value_to_c_string(ctx, path_ref);
+                result = make_file_attributes(ctx, path, wanted, &values);
+                free(path);
+            }
+            JSObjectSetPropertyAtIndex(ctx, results, (unsigned) i, result ? result : JSValueMakeNull(ctx), NULL);
+        }
+        return results;
     }
     return JSValueMakeNull(ctx);
 }
@@ -1273,11 +2161,10 @@ JSValueRef function_read_password(JSContextRef ctx, JSObjectRef function, JSObje
     return JSValueMakeNull(ctx);
 }
 
-void do_run_timeout(void *data) {
+static void run_timeout(void *data) {
 
     unsigned long *timeout_data = data;
 
-    acquire_eval_lock();
     JSValueRef args[1];
     args[0] = JSValueMakeNumber(ctx, (double)*timeout_data);
     free(timeout_data);
@@ -1288,10 +2175,11 @@ void do_run_timeout(void *data) {
         JSValueProtect(ctx, run_timeout_fn);
     }
     JSObjectCallAsFunction(ctx, run_timeout_fn, NULL, 1, args, NULL);
-    release_eval_lock();
 }
 
-static unsigned long timeout_id = 0;
+void do_run_timeout(void *data) {
+    event_loop_post(run_timeout, data);
+}
 
 JSValueRef function_set_timeout(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                 size_t argc, const JSValueRef args[], JSValueRef *exception) {
@@ -1300,34 +2188,32 @@ JSValueRef function_set_timeout(JSContextRef ctx, JSObjectRef function, JSObject
 
         int millis = (int) JSValueToNumber(ctx, args[0], NULL);
 
-        if (timeout_id == 9007199254740991) {
-            timeout_id = 0;
-        } else {
-            ++timeout_id;
-        }
-
-        JSValueRef rv = JSValueMakeNumber(ctx, (double)timeout_id);
-
+        // The id of the timer is the id of the timeout, so that clearTimeout
+        // can cancel it
         unsigned long *timeout_data = malloc(sizeof(unsigned long));
-        *timeout_data = timeout_id;
 
         int err = signal_task_started();
         if (err) {
             engine_print_err_message("signal_task_started", err);
         }
 
-        start_timer(millis, do_run_timeout, (void *) timeout_data);
+        err = schedule_timer(millis, do_run_timeout, (void *) timeout_data, timeout_data);
+        if (err) {
+            free(timeout_data);
+            engine_print_err_message("start_timer", err);
+            signal_task_complete();
+            return JSValueMakeNull(ctx);
+        }
 
-        return rv;
+        return JSValueMakeNumber(ctx, (double)*timeout_data);
     }
     return JSValueMakeNull(ctx);
 }
 
-void do_run_interval(void *data) {
+static void run_interval(void *data) {
 
     unsigned long *interval_data = data;
 
-    acquire_eval_lock();
     JSValueRef args[1];
     args[0] = JSValueMakeNumber(ctx, (double)*interval_data);
     free(interval_data);
@@ -1339,11 +2225,14 @@ void do_run_interval(void *data) {
     }
 
     JSObjectCallAsFunction(ctx, run_interval_fn, NULL, 1, args, NULL);
-    release_eval_lock();
 }
 
-static unsigned long interval_id = 0;
+void do_run_interval(void *data) {
+    event_loop_post(run_interval, data);
+}
 
+// Starts the timer for the next run of an interval, returning the id of the
+// timer. A new interval takes the id of its first timer as its own.
 JSValueRef function_set_interval(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                  size_t argc, const JSValueRef args[], JSValueRef *exception) {
     if (argc == 2
@@ -1351,36 +2240,87 @@ JSValueRef function_set_interval(JSContextRef ctx, JSObjectRef function, JSObjec
 
         int millis = (int) JSValueToNumber(ctx, args[0], NULL);
 
-        unsigned long curr_interval_id;
-
-        if (JSValueIsNull(ctx, args[1])) {
-            if (interval_id == 9007199254740991) {
-                interval_id = 0;
-            } else {
-                ++interval_id;
-            }
-            curr_interval_id = interval_id;
+        bool new_interval = JSValueIsNull(ctx, args[1]);
 
-            int err = signal_task_started();
+        unsigned long *interval_data = malloc(sizeof(unsigned long));
+        unsigned long timer_id;
+        int err = 0;
+        if (new_interval) {
+            err = signal_task_started();
             if (err) {
                 engine_print_err_message("signal_task_started", err);
             }
         } else {
-            curr_interval_id = (unsigned long) JSValueToNumber(ctx, args[1], NULL);
+            *interval_data = (unsigned long) JSValueToNumber(ctx, args[1], NULL);
         }
 
-        JSValueRef rv = JSValueMakeNumber(ctx, (double)curr_interval_id);
+        err = schedule_timer(millis, do_run_interval, (void *) interval_data,
+                             new_interval ? interval_data : &timer_id);
+        if (err) {
+            free(interval_data);
+            engine_print_err_message("start_timer", err);
+            if (new_interval) {
+                signal_task_complete();
+            }
+            return JSValueMakeNull(ctx);
+        }
 
-        unsigned long *interval_data = malloc(sizeof(unsigned long));
-        *interval_data = curr_interval_id;
+        if (new_interval) {
+            timer_id = *interval_data;
+        }
 
-        start_timer(millis, do_run_interval, (void *) interval_data);
+        return JSValueMakeNumber(ctx, (double)timer_id);
+    }
+    return JSValueMakeNull(ctx);
+}
 
-        return rv;
+JSValueRef function_clear_timer(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1
+        && JSValueGetType(ctx, args[0]) == kJSTypeNumber) {
+
+        void *data;
+        if (cancel_timer((unsigned long) JSValueToNumber(ctx, args[0], NULL), &data)) {
+            free(data);
+        }
     }
     return JSValueMakeNull(ctx);
 }
 
+// Runs the callbacks queued by setImmediate, on the event loop, until none
+// are queued, posting itself again between batches so that other callbacks
+// on the loop get a turn
+static void run_immediates(void *data) {
+
+    static JSObjectRef run_immediates_fn = NULL;
+    if (!run_immediates_fn) {
+        run_immediates_fn = get_function("global", "PLANCK_RUN_IMMEDIATES");
+        JSValueProtect(ctx, run_immediates_fn);
+    }
+
+    // If a callback threw, the rest are still queued
+    JSValueRef more = JSObjectCallAsFunction(ctx, run_immediates_fn, NULL, 0, NULL, NULL);
+    if (more == NULL || JSValueToBoolean(ctx, more)) {
+        event_loop_post(run_immediates, NULL);
+    } else {
+        int err = signal_task_complete();
+        if (err) {
+            engine_print_err_message("signal_task_complete", err);
+        }
+    }
+}
+
+JSValueRef function_schedule_immediates(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                        size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    int err = signal_task_started();
+    if (err) {
+        engine_print_err_message("signal_task_started", err);
+    }
+
+    event_loop_post(run_immediates, NULL);
+    return JSValueMakeNull(ctx);
+}
+
 JSValueRef function_high_res_timer(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                    size_t argc, const JSValueRef args[], JSValueRef *exception) {
 
@@ -1392,23 +2332,40 @@ typedef struct data_arrived_info {
     JSObjectRef data_arrived_cb;
 } data_arrived_info_t;
 
-conn_data_cb_ret_t *socket_conn_data_arrived(char *data, int sock, void *info) {
+struct data_arrived {
+    data_arrived_info_t *data_arrived_info;
+    int sock;
+    char *data;
+};
 
-    data_arrived_info_t *data_arrived_info = info;
+static void run_data_arrived(void *data) {
+
+    struct data_arrived *data_arrived = data;
 
-    acquire_eval_lock();
     JSValueRef args[2];
-    args[0] = JSValueMakeNumber(ctx, sock);
+    args[0] = JSValueMakeNumber(ctx, data_arrived->sock);
 
-    if (data) {
+    if (data_arrived->data) {
         // TODO what if we need bytes instead of dealing with an encoding?
-        args[1] = JSValueMakeString(ctx, JSStringCreateWithUTF8CString(data));
+        args[1] = c_string_to_value(ctx, data_arrived->data);
     } else {
         args[1] = JSValueMakeNull(ctx);
     }
 
-    JSObjectCallAsFunction(ctx, data_arrived_info->data_arrived_cb, NULL, 2, args, NULL);
-    release_eval_lock();
+    JSObjectCallAsFunction(ctx, data_arrived->data_arrived_info->data_arrived_cb, NULL, 2, args, NULL);
+
+    free(data_arrived->data);
+    free(data_arrived);
+}
+
+conn_data_cb_ret_t *socket_conn_data_arrived(char *data, int sock, void *info) {
+
+    // The data is only valid during this call, so it is copied for the event loop
+    struct data_arrived *data_arrived = malloc(sizeof(struct data_arrived));
+    data_arrived->data_arrived_info = info;
+    data_arrived->sock = sock;
+    data_arrived->data = data ? strdup(data) : NULL;
+    event_loop_post(run_data_arrived, data_arrived);
 
     conn_data_cb_ret_t *conn_data_arrived_ret = malloc(sizeof(conn_data_cb_ret_t));
 
@@ -1422,25 +2379,40 @@ typedef struct accept_info {
     JSObjectRef accept_cb;
 } accept_info_t;
 
-accepted_conn_cb_ret_t *accepted_socket_connection(int sock, void *info) {
+struct accepted {
+    accept_info_t *accept_info;
+    int sock;
+    data_arrived_info_t *data_arrived_info;
+};
+
+static void run_accepted(void *data) {
 
-    accept_info_t *accept_info = info;
+    struct accepted *accepted = data;
 
-    acquire_eval_lock();
     JSValueRef args[1];
-    args[0] = JSValueMakeNumber(ctx, sock);
+    args[0] = JSValueMakeNumber(ctx, accepted->sock);
 
-    JSValueRef data_arrived_cb_ref = JSObjectCallAsFunction(ctx, accept_info->accept_cb, NULL, 1, args, NULL);
+    JSValueRef data_arrived_cb_ref = JSObjectCallAsFunction(ctx, accepted->accept_info->accept_cb, NULL, 1, args,
+                                                            NULL);
 
-    data_arrived_info_t *data_arrived_info = malloc(sizeof(data_arrived_info_t));
-    data_arrived_info->data_arrived_cb = JSValueToObject(ctx, data_arrived_cb_ref, NULL);
+    accepted->data_arrived_info = malloc(sizeof(data_arrived_info_t));
+    accepted->data_arrived_info->data_arrived_cb = JSValueToObject(ctx, data_arrived_cb_ref, NULL);
     JSValueProtect(ctx, data_arrived_cb_ref);
-    release_eval_lock();
+}
+
+accepted_conn_cb_ret_t *accepted_socket_connection(int sock, void *info) {
+
+    // The data arrived callback is needed before reading from the socket, so
+    // this waits for the event loop to have called the accept callback
+    struct accepted accepted;
+    accepted.accept_info = info;
+    accepted.sock = sock;
+    event_loop_call(run_accepted, &accepted);
 
     accepted_conn_cb_ret_t *accepted_conn_cb_ret = malloc(sizeof(accepted_conn_cb_ret_t));
 
     accepted_conn_cb_ret->err = 0;
-    accepted_conn_cb_ret->info = data_arrived_info;
+    accepted_conn_cb_ret->info = accepted.data_arrived_info;
 
     return accepted_conn_cb_ret;
 }
@@ -1536,6 +2508,124 @@ JSValueRef function_socket_close(JSContextRef ctx, JSObjectRef function, JSObjec
     return JSValueMakeNull(ctx);
 }
 
+struct worker_reply {
+    unsigned long id;
+    char *reply;
+    bool error;
+    bool stopped;
+};
+
+// Calls back into JavaScript with a reply from a worker, on the event loop
+static void run_worker_reply(void *data) {
+    struct worker_reply *worker_reply = data;
+
+    JSValueRef args[3];
+    args[0] = JSValueMakeNumber(ctx, (double) worker_reply->id);
+    args[1] = JSValueMakeNull(ctx);
+    args[2] = JSValueMakeNull(ctx);
+    if (worker_reply->reply) {
+        args[worker_reply->error ? 2 : 1] = c_string_to_value(ctx, worker_reply->reply);
+    }
+
+    static JSObjectRef run_worker_reply_fn = NULL;
+    if (!run_worker_reply_fn) {
+        run_worker_reply_fn = get_function("global", "PLANCK_RUN_WORKER_REPLY");
+        JSValueProtect(ctx, run_worker_reply_fn);
+    }
+    JSObjectCallAsFunction(ctx, run_worker_reply_fn, NULL, 3, args, NULL);
+
+    if (worker_reply->stopped) {
+        int err = signal_task_complete();
+        if (err) {
+            engine_print_err_message("signal_task_complete", err);
+        }
+    }
+
+    free(worker_reply->reply);
+    free(worker_reply);
+}
+
+// Called on the worker's thread
+static void post_worker_reply(char *reply, bool error, void *data) {
+    struct worker_reply *worker_reply = malloc(sizeof(struct worker_reply));
+    worker_reply->id = (unsigned long) data;
+    worker_reply->reply = reply;
+    worker_reply->error = error;
+    worker_reply->stopped = reply == NULL;
+    event_loop_post(run_worker_reply, worker_reply);
+}
+
+JSValueRef function_worker_start(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                 size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 3
+        && JSValueGetType(ctx, args[0]) == kJSTypeString
+        && JSValueGetType(ctx, args[1]) == kJSTypeObject
+        && JSValueGetType(ctx, args[2]) == kJSTypeNumber) {
+
+        char *fn_source = value_to_c_string(ctx, args[0]);
+        JSObjectRef requires_array = JSValueToObject(ctx, args[1], NULL);
+        size_t num_requires = (size_t) array_get_count(ctx, requires_array);
+        char **requires = malloc(num_requires * sizeof(char *));
+        size_t i;
+        for (i = 0; i < num_requires; i++) {
+            requires[i] = value_to_c_string(ctx, array_get_value_at_index(ctx, requires_array, i));
+        }
+        unsigned long id = (unsigned long) JSValueToNumber(ctx, args[2], NULL);
+
+        worker_t *worker = worker_start(fn_source, requires, num_requires, post_worker_reply, (void *) id);
+
+        free(fn_source);
+        for (i = 0; i < num_requires; i++) {
+            free(requires[i]);
+        }
+        free(requires);
+
+        if (worker == NULL) {
+            *exception = make_error_with_errno(ctx);
+            return JSValueMakeNull(ctx);
+        }
+
+        // A worker keeps the process alive until it is stopped
+        int err = signal_task_started();
+        if (err) {
+            engine_print_err_message("signal_task_started", err);
+        }
+
+        char *descriptor = descriptor_int_to_str((descriptor_t) worker);
+        JSValueRef rv = c_string_to_value(ctx, descriptor);
+        free(descriptor);
+        return rv;
+    }
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_worker_post(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 2
+        && JSValueGetType(ctx, args[0]) == kJSTypeString
+        && JSValueGetType(ctx, args[1]) == kJSTypeString) {
+
+        char *descriptor = value_to_c_string(ctx, args[0]);
+        char *message = value_to_c_string(ctx, args[1]);
+        worker_post((worker_t *) descriptor_str_to_int(descriptor), message);
+        free(message);
+        free(descriptor);
+    }
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_worker_stop(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1
+        && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+
+        char *descriptor = value_to_c_string(ctx, args[0]);
+        worker_stop((worker_t *) descriptor_str_to_int(descriptor));
+        free(descriptor);
+    }
+    return JSValueMakeNull(ctx);
+}
+
 JSValueRef function_sleep(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                           size_t argc, const JSValueRef args[], JSValueRef *exception) {
     if (argc == 2
@@ -12,6 +12,12 @@ JSValueRef
 function_load(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc, const JSValueRef args[],
               JSValueRef *exception);
 
+JSValueRef function_runtime_stats(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                  size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_bundle_exists(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                  size_t argc, const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef function_load_deps_cljs_files(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
                                          const JSValueRef args[], JSValueRef *exception);
 
@@ -25,6 +31,15 @@ JSValueRef
 function_cache(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc, const JSValueRef args[],
                JSValueRef *exception);
 
+JSValueRef function_cache_put(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                              size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_cache_get(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                              size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_write_cache_manifest(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                         size_t argc, const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef
 function_eval(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc, const JSValueRef args[],
               JSValueRef *exception);
@@ -45,6 +60,9 @@ JSValueRef function_exit_with_value(JSContextRef ctx, JSObjectRef function, JSOb
 JSValueRef function_raw_read_stdin(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
                                    const JSValueRef args[], JSValueRef *exception);
 
+JSValueRef function_read_lines(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                               const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef function_raw_write_stdout(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
                                      const JSValueRef args[], JSValueRef *exception);
 
@@ -114,12 +132,33 @@ JSValueRef function_delete_file(JSContextRef ctx, JSObjectRef function, JSObject
 JSValueRef function_copy_file(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                               size_t argc, const JSValueRef args[], JSValueRef *exception);
 
+JSValueRef function_copy_tree(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                              size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_read_async(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                               size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_write_async(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_copy_async(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                               size_t argc, const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef function_list_files(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
                                const JSValueRef args[], JSValueRef *exception);
 
 JSValueRef function_mktemp(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                            size_t argc, const JSValueRef args[], JSValueRef *exception);
 
+JSValueRef function_walk_open(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                              size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_walk(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                         size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_walk_close(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                               size_t argc, const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef function_is_directory(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
                                  const JSValueRef args[], JSValueRef *exception);
 
@@ -127,6 +166,9 @@ JSValueRef
 function_fstat(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc, const JSValueRef args[],
                JSValueRef *exception);
 
+JSValueRef function_fstat_many(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                               size_t argc, const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef function_read_password(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
                                   const JSValueRef args[], JSValueRef *exception);
 
@@ -136,6 +178,12 @@ JSValueRef function_set_timeout(JSContextRef ctx, JSObjectRef function, JSObject
 JSValueRef function_set_interval(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                  size_t argc, const JSValueRef args[], JSValueRef *exception);
 
+JSValueRef function_clear_timer(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_schedule_immediates(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                        size_t argc, const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef function_high_res_timer(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                    size_t argc, const JSValueRef args[], JSValueRef *exception);
 
@@ -151,6 +199,15 @@ JSValueRef function_socket_write(JSContextRef ctx, JSObjectRef function, JSObjec
 JSValueRef function_socket_close(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                  size_t argc, const JSValueRef args[], JSValueRef *exception);
 
+JSValueRef function_worker_start(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                 size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_worker_post(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_worker_stop(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                size_t argc, const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef function_sleep(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                           size_t argc, const JSValueRef args[], JSValueRef *exception);
 
@@ -45,11 +45,15 @@ struct config {
 
     char *socket_repl_host;
     int socket_repl_port;
+    int socket_repl_pool_size;
 
     char *clojurescript_version;
 
     size_t num_compile_opts;
     char **compile_opts;
+
+    char *snapshot_in_path;
+    char *snapshot_out_path;
 };
 
 extern struct config config;
@@ -14,9 +14,22 @@
 #include <string.h>
 #include <limits.h>
 #include <time.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#include "io.h"
 
 #ifdef PLANCK_USE_CLONEFILE
 #include <sys/attr.h>
@@ -25,29 +38,9 @@
 #endif
 
 #define CHUNK_SIZE 1024
-
-char *read_all(FILE *f) {
-    int len = CHUNK_SIZE + 1;
-    char *buf = malloc(len * sizeof(char));
-
-    size_t offset = 0;
-    for (;;) {
-        if (len - offset < CHUNK_SIZE) {
-            len = 2 * len + CHUNK_SIZE;
-            buf = realloc(buf, len * sizeof(char));
-        }
-        size_t n = fread(buf + offset, 1, CHUNK_SIZE, f);
-        offset += n;
-        if (feof(f)) {
-            break;
-        }
-        if (ferror(f)) {
-            return NULL;
-        }
-    }
-    memset(buf + offset, 0, len - offset);
-    return buf;
-}
+#define COPY_BUFFER_SIZE (64 * 1024)
+#define COPY_CHUNK_SIZE (1024 * 1024 * 1024)
+#define READ_ALL_CHUNK_SIZE (64 * 1024)
 
 char *get_contents(char *path, time_t *last_modified) {
     FILE *f = fopen(path, "r");
@@ -88,6 +81,170 @@ char *get_contents(char *path, time_t *last_modified) {
     return NULL;
 }
 
+// Files smaller than this are read rather than mapped: below about 100 KB,
+// the page faults taken touching a fresh mapping cost more than the copy a
+// read makes (see io-bench)
+#define MMAP_MIN_SIZE (128 * 1024)
+
+// Reads fd to the end into a buffer with room for size_hint bytes and a NUL,
+// growing it only if there turns out to be more to read, so that a file whose
+// size is known is read without reallocating.
+static char *read_fd(int fd, size_t size_hint, size_t *length) {
+    size_t capacity = (size_hint ? size_hint : CHUNK_SIZE) + 1;
+    char *buf = malloc(capacity);
+    size_t offset = 0;
+    for (;;) {
+        ssize_t n;
+        if (offset + 1 < capacity) {
+            n = read(fd, buf + offset, capacity - offset - 1);
+        } else {
+            // Full: check for the end of the file before growing
+            char probe[CHUNK_SIZE];
+            n = read(fd, probe, sizeof(probe));
+            if (n > 0) {
+                capacity = 2 * capacity + CHUNK_SIZE;
+                buf = realloc(buf, capacity);
+                memcpy(buf + offset, probe, (size_t) n);
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(buf);
+            return NULL;
+        }
+        if (n == 0) {
+            break;
+        }
+        offset += n;
+    }
+    buf[offset] = '\0';
+    *length = offset;
+    return buf;
+}
+
+char *read_all(int fd) {
+    size_t length;
+    return read_fd(fd, READ_ALL_CHUNK_SIZE, &length);
+}
+
+int get_contents_view(const char *path, time_t *last_modified, contents_view_t *view) {
+    memset(view, 0, sizeof(contents_view_t));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat f_stat;
+    if (fstat(fd, &f_stat) < 0) {
+        goto err;
+    }
+
+    if (last_modified != NULL) {
+        *last_modified = f_stat.st_mtime;
+    }
+
+    // Only the size found here is read from a mapping, so a file growing
+    // afterwards is harmless; one shrinking is handled by with_contents_view.
+    size_t size = (size_t) f_stat.st_size;
+    if (S_ISREG(f_stat.st_mode) && size >= MMAP_MIN_SIZE) {
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            close(fd);
+            view->contents = map;
+            view->length = size;
+            view->mapped_length = size;
+            return 0;
+        }
+    }
+
+    // Pipes and other special files report no meaningful size, so are read
+    // until end of file
+    char *buf = read_fd(fd, S_ISREG(f_stat.st_mode) ? size : 0, &view->length);
+    if (buf == NULL) {
+        goto err;
+    }
+    close(fd);
+    view->contents = buf;
+    return 0;
+
+    err:
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+// The jump buffer of the with_contents_view call, if any, on this thread
+static __thread sigjmp_buf *contents_view_fault;
+
+static struct sigaction previous_sigbus_action;
+
+static void contents_view_sigbus_handler(int sig, siginfo_t *info, void *context) {
+    if (contents_view_fault != NULL) {
+        siglongjmp(*contents_view_fault, 1);
+    }
+    // Not from a mapping being read: chain to the previous disposition
+    if (previous_sigbus_action.sa_flags & SA_SIGINFO) {
+        previous_sigbus_action.sa_sigaction(sig, info, context);
+    } else if (previous_sigbus_action.sa_handler == SIG_DFL) {
+        // Terminate as the default action would, once this handler returns
+        signal(SIGBUS, SIG_DFL);
+        raise(SIGBUS);
+    } else if (previous_sigbus_action.sa_handler != SIG_IGN) {
+        previous_sigbus_action.sa_handler(sig);
+    }
+}
+
+static pthread_once_t contents_view_sigbus_once = PTHREAD_ONCE_INIT;
+
+static void install_contents_view_sigbus_handler() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = contents_view_sigbus_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, &previous_sigbus_action);
+}
+
+int with_contents_view(const contents_view_t *view,
+                       void (*fn)(const char *contents, size_t length, void *data), void *data) {
+    if (!view->mapped_length) {
+        fn(view->contents, view->length, data);
+        return 0;
+    }
+
+    pthread_once(&contents_view_sigbus_once, install_contents_view_sigbus_handler);
+
+    // A file truncated after being mapped faults when the pages past its new
+    // end are touched
+    sigjmp_buf fault;
+    if (sigsetjmp(fault, 1) != 0) {
+        contents_view_fault = NULL;
+        errno = EIO;
+        return -1;
+    }
+    contents_view_fault = &fault;
+    fn(view->contents, view->length, data);
+    contents_view_fault = NULL;
+    return 0;
+}
+
+void release_contents_view(contents_view_t *view) {
+    if (view->contents != NULL) {
+        if (view->mapped_length) {
+            munmap((void *) view->contents, view->mapped_length);
+        } else {
+            free((void *) view->contents);
+        }
+    }
+    memset(view, 0, sizeof(contents_view_t));
+}
+
 void write_contents(char *path, char *contents) {
     FILE *f = fopen(path, "w");
     if (f == NULL) {
@@ -157,9 +314,58 @@ int mkdir_parents(const char *path) {
     return 0;
 }
 
+#ifdef __linux__
+// Copies the rest of fd_from to fd_to without passing the data through user
+// space: with copy_file_range, which lets the filesystem share extents or
+// copy on the server, and otherwise with sendfile. Returns 0 once done, -1 on
+// error, or 1 if neither can be used for these files, before anything has
+// been copied.
+static int copy_fd_in_kernel(int fd_from, int fd_to) {
+    struct stat st;
+    // Files in /proc and the like report a size of 0 but have contents,
+    // which only read sees
+    if (fstat(fd_from, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return 1;
+    }
+
+    bool copied = false;
+    ssize_t n;
+#ifdef __NR_copy_file_range
+    // Called through syscall, as glibc only wraps it since 2.27
+    while ((n = syscall(__NR_copy_file_range, fd_from, NULL, fd_to, NULL, COPY_CHUNK_SIZE, 0)) != 0) {
+        if (n > 0) {
+            copied = true;
+        } else if (errno != EINTR) {
+            if (copied || !(errno == ENOSYS || errno == EXDEV || errno == EINVAL
+                            || errno == EOPNOTSUPP || errno == EPERM || errno == EBADF)) {
+                return -1;
+            }
+            break;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+#endif
+
+    while ((n = sendfile(fd_to, fd_from, NULL, COPY_CHUNK_SIZE)) != 0) {
+        if (n > 0) {
+            copied = true;
+        } else if (errno != EINTR) {
+            return copied || !(errno == ENOSYS || errno == EINVAL) ? -1 : 1;
+        }
+    }
+    return 0;
+}
+#else
+static int copy_fd_in_kernel(int fd_from, int fd_to) {
+    return 1;
+}
+#endif
+
 int copy_file_loop(const char *from, const char *to) {
     int fd_to, fd_from;
-    char buf[4096];
+    char buf[COPY_BUFFER_SIZE];
     ssize_t nread;
     int saved_errno;
 
@@ -171,7 +377,12 @@ int copy_file_loop(const char *from, const char *to) {
     if (fd_to < 0)
         goto out_error;
 
-    while (nread = read(fd_from, buf, sizeof buf), nread > 0) {
+    int kernel_rv = copy_fd_in_kernel(fd_from, fd_to);
+    if (kernel_rv < 0)
+        goto out_error;
+
+    nread = 0;
+    while (kernel_rv > 0 && (nread = read(fd_from, buf, sizeof buf)) > 0) {
         char *out_ptr = buf;
         ssize_t nwritten;
 
@@ -250,3 +461,225 @@ int copy_file(const char *from, const char *to) {
 #endif
 
 }
+
+static int copy_symlink(const char *from, const char *to) {
+    char target[PATH_MAX];
+    ssize_t len = readlink(from, target, sizeof(target) - 1);
+    if (len < 0) {
+        return -1;
+    }
+    target[len] = '\0';
+
+    if (symlink(target, to) < 0) {
+        if (errno != EEXIST || unlink(to) < 0 || symlink(target, to) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int copy_tree_entry(const char *from, const char *to, bool follow_links) {
+    struct stat st;
+    if ((follow_links ? stat(from, &st) : lstat(from, &st)) < 0) {
+        return -1;
+    }
+
+    if (S_ISLNK(st.st_mode)) {
+        return copy_symlink(from, to);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return copy_file(from, to);
+    }
+
+    if (mkdir_p((char *) to) < 0) {
+        return -1;
+    }
+
+    DIR *dir = opendir(from);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    size_t from_len = strlen(from);
+    size_t to_len = strlen(to);
+    int rv = 0;
+    struct dirent *entry;
+    while (rv == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        size_t name_len = strlen(entry->d_name);
+        char *entry_from = malloc(from_len + name_len + 2);
+        char *entry_to = malloc(to_len + name_len + 2);
+        sprintf(entry_from, "%s/%s", from, entry->d_name);
+        sprintf(entry_to, "%s/%s", to, entry->d_name);
+
+        rv = copy_tree_entry(entry_from, entry_to, false);
+
+        free(entry_from);
+        free(entry_to);
+    }
+
+    int saved_errno = errno;
+    closedir(dir);
+    errno = saved_errno;
+    return rv;
+}
+
+// Whether path, once the part of it that exists is resolved, is the file st or
+// lies somewhere below it
+static bool is_within(const char *path, const struct stat *st) {
+    char prefix[PATH_MAX];
+    char resolved[PATH_MAX];
+    if (strlen(path) >= sizeof(prefix)) {
+        return false;
+    }
+    strcpy(prefix, path);
+
+    while (realpath(prefix, resolved) == NULL) {
+        char *slash = strrchr(prefix, '/');
+        if (slash == NULL) {
+            if (strcmp(prefix, ".") == 0) {
+                return false;
+            }
+            strcpy(prefix, ".");
+        } else if (slash == prefix) {
+            prefix[1] = '\0';
+        } else {
+            *slash = '\0';
+        }
+    }
+
+    // The resolved path is canonical, so its parents can be found by
+    // trimming components
+    for (;;) {
+        struct stat resolved_st;
+        if (stat(resolved, &resolved_st) == 0
+            && resolved_st.st_dev == st->st_dev && resolved_st.st_ino == st->st_ino) {
+            return true;
+        }
+        char *slash = strrchr(resolved, '/');
+        if (slash == NULL || resolved[1] == '\0') {
+            return false;
+        }
+        if (slash == resolved) {
+            resolved[1] = '\0';
+        } else {
+            *slash = '\0';
+        }
+    }
+}
+
+// Creates the directories containing path that don't already exist
+static int mkdir_ancestors(const char *path) {
+    char ancestor[PATH_MAX];
+    if (strlen(path) >= sizeof(ancestor)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(ancestor, path);
+
+    char *p;
+    for (p = ancestor + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir_p(ancestor) < 0) {
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    return 0;
+}
+
+int copy_tree(const char *from, const char *to) {
+    struct stat st;
+    if (stat(from, &st) < 0) {
+        return -1;
+    }
+
+    // Copying a directory into itself would never finish, and copying a file
+    // onto itself would truncate it
+    if (is_within(to, &st)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (mkdir_ancestors(to) < 0) {
+        return -1;
+    }
+
+    return copy_tree_entry(from, to, true);
+}
+
+#ifdef IO_BENCH
+
+// Compares reading files with get_contents and get_contents_view, touching
+// every byte as decoding the contents would. For example, after
+// caching a large project:
+//
+//   build/io-bench 20 .planck_cache/*.js
+
+static double bench_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static size_t bench_sum(const char *contents, size_t length) {
+    size_t sum = 0;
+    size_t i;
+    for (i = 0; i < length; i++) {
+        sum += (unsigned char) contents[i];
+    }
+    return sum;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s rounds file ...\n", argv[0]);
+        return 1;
+    }
+    int rounds = atoi(argv[1]);
+
+    int round;
+    int i;
+    size_t bytes = 0;
+    size_t checksum = 0;
+    double start = bench_seconds();
+    for (round = 0; round < rounds; round++) {
+        for (i = 2; i < argc; i++) {
+            char *contents = get_contents(argv[i], NULL);
+            if (contents != NULL) {
+                size_t len = strlen(contents);
+                bytes += len;
+                checksum += bench_sum(contents, len);
+                free(contents);
+            }
+        }
+    }
+    double elapsed = bench_seconds() - start;
+    printf("get_contents:      %d files, %.1f MB in %.3f s: %.1f MB/s (%zu)\n",
+           argc - 2, bytes / 1e6, elapsed, bytes / 1e6 / elapsed, checksum);
+
+    bytes = 0;
+    checksum = 0;
+    start = bench_seconds();
+    for (round = 0; round < rounds; round++) {
+        for (i = 2; i < argc; i++) {
+            contents_view_t view;
+            if (get_contents_view(argv[i], NULL, &view) == 0) {
+                bytes += view.length;
+                checksum += bench_sum(view.contents, view.length);
+                release_contents_view(&view);
+            }
+        }
+    }
+    elapsed = bench_seconds() - start;
+    printf("get_contents_view: %d files, %.1f MB in %.3f s: %.1f MB/s (%zu)\n",
+           argc - 2, bytes / 1e6, elapsed, bytes / 1e6 / elapsed, checksum);
+
+    return 0;
+}
+
+#endif
@@ -1,13 +1,41 @@
+#include <stddef.h>
+#include <stdio.h>
 #include <time.h>
 
-char *read_all(FILE *f);
+// Reads fd until the end of the file, returning a NUL-terminated buffer, or
+// NULL on error
+char *read_all(int fd);
 
 char *get_contents(char *path, time_t *last_modified);
 
+// A read-only view of the length bytes of a file's contents, either mapped
+// into memory or read into a buffer. Only contents read into a buffer are
+// NUL-terminated.
+typedef struct {
+    const char *contents;
+    size_t length;
+    size_t mapped_length;
+} contents_view_t;
+
+int get_contents_view(const char *path, time_t *last_modified, contents_view_t *view);
+
+// Calls fn with the view's contents. Returns 0, or -1 with errno set to EIO if
+// the file was truncated while fn was reading a mapping of it, in which case
+// fn will have been interrupted.
+int with_contents_view(const contents_view_t *view,
+                       void (*fn)(const char *contents, size_t length, void *data), void *data);
+
+void release_contents_view(contents_view_t *view);
+
 void write_contents(char *path, char *contents);
 
 int mkdir_p(char *path);
 
 int mkdir_parents(const char *path);
 
-int copy_file(const char *from, const char *to);
\ No newline at end of file
+int copy_file(const char *from, const char *to);
+
+// Copies the file or directory tree at from to to, creating directories as
+// needed. Symbolic links within the tree are recreated rather than followed.
+// Stops at the first failure, returning -1 with errno set.
+int copy_tree(const char *from, const char *to);
\ No newline at end of file
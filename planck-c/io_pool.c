@@ -0,0 +1,87 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "io_pool.h"
+
+#define IO_POOL_THREADS 4
+
+struct io_job {
+    io_work_t work;
+    void *data;
+    struct io_job *next;
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct io_job *queue_head = NULL;
+static struct io_job *queue_tail = NULL;
+static int num_threads = 0;
+
+static void *worker_thread(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        struct io_job *job = queue_head;
+        queue_head = job->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue_lock);
+
+        job->work(job->data);
+        free(job);
+    }
+    return NULL;
+}
+
+// Called with the queue lock held
+static int start_threads() {
+    pthread_attr_t attr;
+    int err = pthread_attr_init(&attr);
+    if (err) {
+        return err;
+    }
+
+    err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (!err && num_threads < IO_POOL_THREADS) {
+        pthread_t thread;
+        err = pthread_create(&thread, &attr, worker_thread, NULL);
+        if (!err) {
+            num_threads++;
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+    // Make do with however many threads could be started
+    return num_threads > 0 ? 0 : err;
+}
+
+int io_pool_submit(io_work_t work, void *data) {
+    struct io_job *job = malloc(sizeof(struct io_job));
+    if (!job) return ENOMEM;
+
+    job->work = work;
+    job->data = data;
+    job->next = NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    int err = num_threads == 0 ? start_threads() : 0;
+    if (err) {
+        pthread_mutex_unlock(&queue_lock);
+        free(job);
+        return err;
+    }
+
+    if (queue_tail) {
+        queue_tail->next = job;
+    } else {
+        queue_head = job;
+    }
+    queue_tail = job;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+}
@@ -0,0 +1,8 @@
+// A pool of threads for performing blocking I/O off the JavaScript thread.
+
+typedef void (*io_work_t)(void *data);
+
+// Queues work to be called with data on one of the pool's threads, starting
+// the pool on first use. Returns 0, or an error number if the job could not
+// be queued or the pool could not be started.
+int io_pool_submit(io_work_t work, void *data);
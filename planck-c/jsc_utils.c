@@ -31,16 +31,21 @@ void print_value(char *prefix, JSContextRef ctx, JSValueRef val) {
     }
 }
 
-JSValueRef evaluate_script(JSContextRef ctx, char *script, char *source) {
+JSValueRef evaluate_script(JSContextRef ctx, const char *script, const char *source) {
     JSStringRef script_ref = JSStringCreateWithUTF8CString(script);
+    JSValueRef val = evaluate_script_string(ctx, script_ref, source);
+    JSStringRelease(script_ref);
+    return val;
+}
+
+JSValueRef evaluate_script_string(JSContextRef ctx, JSStringRef script, const char *source) {
     JSStringRef source_ref = NULL;
     if (source != NULL) {
         source_ref = JSStringCreateWithUTF8CString(source);
     }
 
     JSValueRef ex = NULL;
-    JSValueRef val = JSEvaluateScript(ctx, script_ref, NULL, source_ref, 0, &ex);
-    JSStringRelease(script_ref);
+    JSValueRef val = JSEvaluateScript(ctx, script, NULL, source_ref, 0, &ex);
     if (source != NULL) {
         JSStringRelease(source_ref);
     }
@@ -75,19 +80,17 @@ char *value_to_c_string_ext(JSContextRef ctx, JSValueRef val, bool handle_non_st
                 sprintf(result, "%s\n%s", message, stack);
                 return result;
             } else {
-                static JSObjectRef stringify_fn = NULL;
-
-                if (!stringify_fn) {
-                    JSStringRef json_str = JSStringCreateWithUTF8CString("JSON");
-                    JSValueRef json_prop = JSObjectGetProperty(ctx, JSContextGetGlobalObject(ctx), json_str, NULL);
-                    JSObjectRef json_obj = JSValueToObject(ctx, json_prop, NULL);
-                    JSStringRelease(json_str);
-                    JSStringRef stringify_str = JSStringCreateWithUTF8CString("stringify");
-                    JSValueRef stringify_prop = JSObjectGetProperty(ctx, json_obj, stringify_str, NULL);
-                    JSStringRelease(stringify_str);
-                    stringify_fn = JSValueToObject(ctx, stringify_prop, NULL);
-                    JSValueProtect(ctx, stringify_fn);
-                }
+                // Looked up in the calling context each time, as contexts
+                // in other engines (session engines and workers) have
+                // their own JSON object
+                JSStringRef json_str = JSStringCreateWithUTF8CString("JSON");
+                JSValueRef json_prop = JSObjectGetProperty(ctx, JSContextGetGlobalObject(ctx), json_str, NULL);
+                JSObjectRef json_obj = JSValueToObject(ctx, json_prop, NULL);
+                JSStringRelease(json_str);
+                JSStringRef stringify_str = JSStringCreateWithUTF8CString("stringify");
+                JSValueRef stringify_prop = JSObjectGetProperty(ctx, json_obj, stringify_str, NULL);
+                JSStringRelease(stringify_str);
+                JSObjectRef stringify_fn = JSValueToObject(ctx, stringify_prop, NULL);
 
                 size_t num_arguments = 3;
                 JSValueRef arguments[num_arguments];
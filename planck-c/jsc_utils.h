@@ -10,7 +10,9 @@ JSStringRef to_string(JSContextRef ctx, JSValueRef val);
 
 void print_value(char *prefix, JSContextRef ctx, JSValueRef val);
 
-JSValueRef evaluate_script(JSContextRef ctx, char *script, char *source);
+JSValueRef evaluate_script(JSContextRef ctx, const char *script, const char *source);
+
+JSValueRef evaluate_script_string(JSContextRef ctx, JSStringRef script, const char *source);
 
 char *value_to_c_string(JSContextRef ctx, JSValueRef val);
 
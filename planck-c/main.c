@@ -23,6 +23,7 @@
 #include "theme.h"
 #include "tasks.h"
 #include "clock.h"
+#include "output.h"
 
 void ignore_sigpipe() {
     struct sigaction sa;
@@ -67,6 +68,8 @@ void usage(char *program_name) {
     "    -d, --dumb-terminal         Disable line editing / VT100 terminal control\n"
     "    -t theme, --theme theme     Set the color theme\n"
     "    -n x, --socket-repl x       Enable socket REPL where x is port or IP:port\n"
+    "    --socket-repl-engines n     Give each socket REPL session an engine of its\n"
+    "                                own, keeping n ready ahead of time\n"
     "    -s, --static-fns            Generate static dispatch function calls\n"
     "    -f, --fn-invoke-direct      Do not not generate .call(null...) calls\n"
     "                                for unknown functions, but instead direct\n"
@@ -76,6 +79,9 @@ void usage(char *program_name) {
     "    -A x, --checked-arrays x    Enables checked arrays where x is either warn\n"
     "                                or error.\n"
     "    -a, --elide-asserts         Set *assert* to false to remove asserts\n"
+    "    --snapshot-out path         Record a startup snapshot to path\n"
+    "    --snapshot-in path          Start from a snapshot recorded with\n"
+    "                                --snapshot-out\n"
     "\n"
     "  main options:\n"
     "    -m ns-name, --main ns-name Call the -main function from a namespace with\n"
@@ -404,12 +410,16 @@ int main(int argc, char **argv) {
 
     config.socket_repl_port = 0;
     config.socket_repl_host = NULL;
+    config.socket_repl_pool_size = 0;
 
     config.clojurescript_version = get_cljs_version();
 
     config.num_compile_opts = 0;
     config.compile_opts = NULL;
 
+    config.snapshot_in_path = NULL;
+    config.snapshot_out_path = NULL;
+
     char *classpath = NULL;
     char *dependencies = NULL;
     char *local_repo = NULL;
@@ -439,6 +449,9 @@ int main(int argc, char **argv) {
             {"init",             required_argument, NULL, 'i'},
             {"main",             required_argument, NULL, 'm'},
             {"compile-opts",     required_argument, NULL, '\1'},
+            {"snapshot-in",      required_argument, NULL, '\2'},
+            {"snapshot-out",     required_argument, NULL, '\3'},
+            {"socket-repl-engines", required_argument, NULL, '\4'},
 
             // development options
             {"javascript",       no_argument,       NULL, 'j'},
@@ -452,11 +465,24 @@ int main(int argc, char **argv) {
     // pass index_of_script_path_or_hyphen instead of argc to guarantee that everything
     // after a bare dash "-" or a script path gets passed as *command-line-args*
     while (!did_encounter_main_opt &&
-           (opt = getopt_long(index_of_script_path_or_hyphen, argv, "O:Xh?VS:D:L:\1:lvrA:sfak:je:t:n:dc:o:Ki:qm:", long_options, &option_index)) != -1) {
+           (opt = getopt_long(index_of_script_path_or_hyphen, argv, "O:Xh?VS:D:L:\1:\2:\3:\4:lvrA:sfak:je:t:n:dc:o:Ki:qm:", long_options, &option_index)) != -1) {
         switch (opt) {
             case '\1':
                 process_compile_opts(optarg);
                 break;
+            case '\2':
+                config.snapshot_in_path = strdup(optarg);
+                break;
+            case '\3':
+                config.snapshot_out_path = strdup(optarg);
+                break;
+            case '\4':
+                config.socket_repl_pool_size = atoi(optarg);
+                if (config.socket_repl_pool_size < 1) {
+                    print_usage_error("socket-repl-engines value must be a positive number", argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
             case 'X':
                 init_launch_timing();
                 break;
@@ -671,6 +697,7 @@ int main(int argc, char **argv) {
     }
 
     config.is_tty = isatty(STDIN_FILENO) == 1;
+    output_init();
 
     display_launch_timing("check tty");
 
@@ -697,7 +724,7 @@ int main(int argc, char **argv) {
 
         struct script script;
         if (strcmp(path, "-") == 0) {
-            char *source = read_all(stdin);
+            char *source = read_all(STDIN_FILENO);
             script.type = "text";
             script.source = source;
             script.expression = false;
@@ -0,0 +1,121 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "jsc_utils.h"
+#include "output.h"
+#include "timers.h"
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define FLUSH_INTERVAL_MILLIS 100
+
+static bool buffered = false;
+static bool flush_scheduled = false;
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void output_init(void) {
+    buffered = isatty(STDOUT_FILENO) != 1;
+    if (buffered) {
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
+}
+
+static void flush_callback(void *data) {
+    pthread_mutex_lock(&flush_mutex);
+    flush_scheduled = false;
+    pthread_mutex_unlock(&flush_mutex);
+    fflush(stdout);
+}
+
+static void schedule_flush(void) {
+    pthread_mutex_lock(&flush_mutex);
+    if (!flush_scheduled) {
+        flush_scheduled = start_timer(FLUSH_INTERVAL_MILLIS, flush_callback, NULL) == 0;
+        if (!flush_scheduled) {
+            fflush(stdout);
+        }
+    }
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+// Keeps output to standard out and standard error in order, for when they
+// are the same file
+static void begin_write(FILE *stream) {
+    if (buffered && stream != stdout) {
+        fflush(stdout);
+    }
+}
+
+static void end_write(FILE *stream) {
+    if (buffered && stream == stdout) {
+        schedule_flush();
+    }
+}
+
+static void write_chars(FILE *stream, const JSChar *chars, size_t length) {
+    // Encode in chunks on the stack, so that nothing is allocated
+    char buf[4096 + 4];
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i < length; i++) {
+        uint32_t c = chars[i];
+        if (c >= 0xD800 && c <= 0xDFFF) {
+            if (c <= 0xDBFF && i + 1 < length && chars[i + 1] >= 0xDC00 && chars[i + 1] <= 0xDFFF) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (chars[++i] - 0xDC00);
+            } else {
+                c = 0xFFFD;
+            }
+        }
+
+        if (c < 0x80) {
+            buf[n++] = (char) c;
+        } else if (c < 0x800) {
+            buf[n++] = (char) (0xC0 | (c >> 6));
+            buf[n++] = (char) (0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            buf[n++] = (char) (0xE0 | (c >> 12));
+            buf[n++] = (char) (0x80 | ((c >> 6) & 0x3F));
+            buf[n++] = (char) (0x80 | (c & 0x3F));
+        } else {
+            buf[n++] = (char) (0xF0 | (c >> 18));
+            buf[n++] = (char) (0x80 | ((c >> 12) & 0x3F));
+            buf[n++] = (char) (0x80 | ((c >> 6) & 0x3F));
+            buf[n++] = (char) (0x80 | (c & 0x3F));
+        }
+
+        if (n >= 4096) {
+            fwrite(buf, 1, n, stream);
+            n = 0;
+        }
+    }
+    fwrite(buf, 1, n, stream);
+}
+
+void output_write(FILE *stream, JSStringRef s) {
+    begin_write(stream);
+    write_chars(stream, JSStringGetCharactersPtr(s), JSStringGetLength(s));
+    end_write(stream);
+}
+
+void output_print(FILE *stream, JSContextRef ctx, JSValueRef value) {
+    begin_write(stream);
+    if (JSValueIsString(ctx, value)) {
+        JSStringRef s = JSValueToStringCopy(ctx, value, NULL);
+        write_chars(stream, JSStringGetCharactersPtr(s), JSStringGetLength(s));
+        JSStringRelease(s);
+    } else {
+        char *str = value_to_c_string_ext(ctx, value, true);
+        fprintf(stream, "%s", str);
+        free(str);
+    }
+    end_write(stream);
+
+    if (!buffered || stream != stdout) {
+        fflush(stream);
+    }
+}
+
+void output_flush(void) {
+    fflush(stdout);
+}
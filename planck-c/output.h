@@ -0,0 +1,19 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <JavaScriptCore/JavaScript.h>
+
+// Output to standard out. When it isn't a terminal, standard out is block
+// buffered rather than flushed on every print, with anything buffered
+// flushed shortly afterwards by a timer, when full, on an explicit flush,
+// before printing to standard error, and at exit.
+
+void output_init(void);
+
+// Writes the characters of s to stream, encoded as UTF-8
+void output_write(FILE *stream, JSStringRef s);
+
+// Prints value to stream, flushing it unless it is a buffered standard out
+void output_print(FILE *stream, JSContextRef ctx, JSValueRef value);
+
+// Flushes any buffered output to standard out
+void output_flush(void);
@@ -0,0 +1,348 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bundle.h"
+#include "engine.h"
+#include "prefetch.h"
+#include "strmap.h"
+
+// Inflates bundled scripts ahead of AMBLY_IMPORT_SCRIPT on a pool of worker
+// threads. The first worker plans the prefetch order from the goog.addDependency
+// calls in main.js and goog/deps.js, after which all workers inflate the
+// planned scripts in order, staying at most PREFETCH_WINDOW scripts ahead of
+// the scripts taken by the engine thread.
+
+#define PREFETCH_MAX_THREADS 4
+#define PREFETCH_WINDOW 32
+
+#define SLOT_PENDING 0
+#define SLOT_INFLATING 1
+#define SLOT_READY 2
+#define SLOT_TAKEN 3
+
+struct prefetch_slot {
+    char *path;
+    char *contents;
+    int state;
+};
+
+struct dependency {
+    char *path;
+    char **provides;
+    size_t num_provides;
+    char **requires;
+    size_t num_requires;
+    bool visited;
+};
+
+static bool active = false;
+static bool planned = false;
+static bool stopping = false;
+
+static char *main_deps = NULL;
+
+static struct prefetch_slot *slots = NULL;
+static size_t num_slots = 0;
+static strmap_t *slot_index = NULL;
+static size_t next_slot = 0;
+static size_t taken_upto = 0;
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t threads[PREFETCH_MAX_THREADS];
+static int num_threads = 0;
+
+// Parses a quoted string at *p, advancing past it
+static char *parse_quoted(char **p) {
+    char *s = *p;
+    while (*s == ' ' || *s == '\t' || *s == '\n') {
+        s++;
+    }
+    if (*s != '\'' && *s != '"') {
+        return NULL;
+    }
+    char quote = *s++;
+    char *end = strchr(s, quote);
+    if (end == NULL) {
+        return NULL;
+    }
+    *p = end + 1;
+    return strndup(s, end - s);
+}
+
+// Parses a bracketed list of quoted strings at *p, advancing past it
+static char **parse_list(char **p, size_t *count) {
+    char *s = strchr(*p, '[');
+    if (s == NULL) {
+        return NULL;
+    }
+    char *end = strchr(s, ']');
+    if (end == NULL) {
+        return NULL;
+    }
+
+    char **items = NULL;
+    *count = 0;
+    s++;
+    while (s < end) {
+        char *item = parse_quoted(&s);
+        if (item == NULL || s > end) {
+            free(item);
+            break;
+        }
+        items = realloc(items, (*count + 1) * sizeof(char *));
+        items[(*count)++] = item;
+        while (s < end && (*s == ',' || *s == ' ' || *s == '\n')) {
+            s++;
+        }
+    }
+    *p = end + 1;
+    return items;
+}
+
+static void parse_deps(const char *deps_js, struct dependency **deps, size_t *num_deps, strmap_t *provides) {
+    const char *marker = "goog.addDependency(";
+    char *p = (char *) deps_js;
+    while ((p = strstr(p, marker)) != NULL) {
+        p += strlen(marker);
+
+        char *src = parse_quoted(&p);
+        if (src == NULL) {
+            continue;
+        }
+
+        size_t num_provides = 0;
+        char **provided = parse_list(&p, &num_provides);
+        size_t num_requires = 0;
+        char **requires = parse_list(&p, &num_requires);
+
+        // Paths are relative to goog/, as passed to CLOSURE_IMPORT_SCRIPT
+        char *path = NULL;
+        if (strncmp(src, "../", 3) == 0) {
+            path = strdup(src + 3);
+        } else {
+            path = malloc(strlen(src) + 6);
+            sprintf(path, "goog/%s", src);
+        }
+        free(src);
+
+        *deps = realloc(*deps, (*num_deps + 1) * sizeof(struct dependency));
+        struct dependency *dep = &(*deps)[*num_deps];
+        dep->path = path;
+        dep->provides = provided;
+        dep->num_provides = num_provides;
+        dep->requires = requires;
+        dep->num_requires = num_requires;
+        dep->visited = false;
+
+        size_t i;
+        for (i = 0; i < num_provides; i++) {
+            strmap_put(provides, provided[i], (void *) (*num_deps + 1));
+        }
+        (*num_deps)++;
+    }
+}
+
+static void add_slot(const char *path, char *contents) {
+    if (strmap_contains(slot_index, path)) {
+        free(contents);
+        return;
+    }
+    slots = realloc(slots, (num_slots + 1) * sizeof(struct prefetch_slot));
+    slots[num_slots].path = strdup(path);
+    slots[num_slots].contents = contents;
+    slots[num_slots].state = contents ? SLOT_READY : SLOT_PENDING;
+    num_slots++;
+    strmap_put(slot_index, slots[num_slots - 1].path, (void *) num_slots);
+}
+
+// Adds the dependencies of a namespace in the order the Closure debug loader
+// would request them
+static void visit(const char *name, struct dependency *deps, strmap_t *provides) {
+    size_t n = (size_t) strmap_get(provides, name);
+    if (n == 0 || deps[n - 1].visited) {
+        return;
+    }
+    struct dependency *dep = &deps[n - 1];
+    dep->visited = true;
+
+    size_t i;
+    for (i = 0; i < dep->num_requires; i++) {
+        visit(dep->requires[i], deps, provides);
+    }
+
+    if (bundle_exists(dep->path)) {
+        add_slot(dep->path, NULL);
+    }
+}
+
+static void plan() {
+    struct dependency *deps = NULL;
+    size_t num_deps = 0;
+    strmap_t *provides = strmap_create(2048);
+
+    // goog/deps.js is itself imported by goog/base.js, so it leads the queue
+    char *goog_deps = bundle_get_contents("goog/deps.js");
+
+    pthread_mutex_lock(&prefetch_lock);
+    slot_index = strmap_create(1024);
+    if (goog_deps) {
+        add_slot("goog/deps.js", strdup(goog_deps));
+        parse_deps(goog_deps, &deps, &num_deps, provides);
+    }
+    parse_deps(main_deps, &deps, &num_deps, provides);
+
+    visit("cljs.core", deps, provides);
+    visit("planck.repl", deps, provides);
+
+    planned = true;
+    pthread_cond_broadcast(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+
+    size_t i;
+    for (i = 0; i < num_deps; i++) {
+        size_t j;
+        for (j = 0; j < deps[i].num_provides; j++) {
+            free(deps[i].provides[j]);
+        }
+        free(deps[i].provides);
+        for (j = 0; j < deps[i].num_requires; j++) {
+            free(deps[i].requires[j]);
+        }
+        free(deps[i].requires);
+        free(deps[i].path);
+    }
+    free(deps);
+    strmap_free(provides);
+    free(goog_deps);
+    free(main_deps);
+    main_deps = NULL;
+}
+
+static void *prefetch_worker(void *data) {
+    if (data != NULL) {
+        plan();
+    }
+
+    pthread_mutex_lock(&prefetch_lock);
+    while (!stopping) {
+        if (!planned) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        } else if (next_slot >= num_slots) {
+            break;
+        } else if (next_slot >= taken_upto + PREFETCH_WINDOW) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        } else {
+            struct prefetch_slot *slot = &slots[next_slot++];
+            if (slot->state == SLOT_PENDING) {
+                slot->state = SLOT_INFLATING;
+                pthread_mutex_unlock(&prefetch_lock);
+                char *contents = bundle_get_contents(slot->path);
+                pthread_mutex_lock(&prefetch_lock);
+                slot->contents = contents;
+                slot->state = SLOT_READY;
+                pthread_cond_broadcast(&prefetch_cond);
+            }
+        }
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    return NULL;
+}
+
+void prefetch_start(const char *deps_js) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus < 2 || active) {
+        return;
+    }
+
+    main_deps = strdup(deps_js);
+    active = true;
+
+    int n = num_cpus - 1 < PREFETCH_MAX_THREADS ? (int) num_cpus - 1 : PREFETCH_MAX_THREADS;
+    int i;
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&threads[num_threads], NULL, prefetch_worker, i == 0 ? (void *) 1 : NULL) != 0) {
+            engine_perror("pthread_create");
+            break;
+        }
+        num_threads++;
+    }
+
+    if (num_threads == 0) {
+        free(main_deps);
+        main_deps = NULL;
+        active = false;
+    }
+}
+
+char *prefetch_take(const char *path) {
+    if (!active) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&prefetch_lock);
+    while (!planned) {
+        pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+    }
+
+    size_t n = (size_t) strmap_get(slot_index, path);
+    if (n == 0) {
+        pthread_mutex_unlock(&prefetch_lock);
+        return NULL;
+    }
+
+    struct prefetch_slot *slot = &slots[n - 1];
+    while (slot->state == SLOT_INFLATING) {
+        pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+    }
+
+    int state = slot->state;
+    char *contents = slot->contents;
+    slot->contents = NULL;
+    slot->state = SLOT_TAKEN;
+    if (state != SLOT_TAKEN && n > taken_upto) {
+        taken_upto = n;
+        pthread_cond_broadcast(&prefetch_cond);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    // Not yet reached by the workers, so inflate it here rather than wait
+    if (state == SLOT_PENDING) {
+        contents = bundle_get_contents((char *) path);
+    }
+
+    return contents;
+}
+
+void prefetch_finish() {
+    if (!active) {
+        return;
+    }
+
+    pthread_mutex_lock(&prefetch_lock);
+    stopping = true;
+    pthread_cond_broadcast(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+
+    int i;
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    size_t j;
+    for (j = 0; j < num_slots; j++) {
+        free(slots[j].path);
+        free(slots[j].contents);
+    }
+    free(slots);
+    slots = NULL;
+    num_slots = 0;
+    strmap_free(slot_index);
+    slot_index = NULL;
+    active = false;
+}
@@ -0,0 +1,7 @@
+// Prefetching of bundled scripts during bootstrap
+
+void prefetch_start(const char *deps_js);
+
+char *prefetch_take(const char *path);
+
+void prefetch_finish();
@@ -12,6 +12,7 @@
 #include "engine.h"
 #include "globals.h"
 #include "keymap.h"
+#include "session.h"
 #include "sockets.h"
 #include "str.h"
 #include "theme.h"
@@ -26,6 +27,8 @@ struct repl {
     size_t num_previous_lines;
     char **previous_lines;
     int session_id;
+    // The session's own engine, if it has one
+    session_t *session;
 };
 
 typedef struct repl repl_t;
@@ -40,6 +43,7 @@ repl_t *make_repl() {
     repl->num_previous_lines = 0;
     repl->previous_lines = NULL;
     repl->session_id = 0;
+    repl->session = NULL;
     return repl;
 }
 
@@ -178,7 +182,8 @@ bool process_line(repl_t *repl, char *input_line, bool split_on_newlines) {
     char *balance_text = NULL;
 
     while (!done) {
-        if ((balance_text = is_readable(repl->input)) != NULL) {
+        balance_text = repl->session ? session_is_readable(repl->session, repl->input) : is_readable(repl->input);
+        if (balance_text != NULL) {
             repl->input[strlen(repl->input) - strlen(balance_text)] = '\0';
 
             if (!is_whitespace(repl->input)) { // Guard against empty string being read
@@ -193,8 +198,12 @@ bool process_line(repl_t *repl, char *input_line, bool split_on_newlines) {
 
                 const char *theme = repl->session_id == 0 ? config.theme : "dumb";
 
-                evaluate_source("text", repl->input, true, true, repl->current_ns, theme, true,
-                                repl->session_id);
+                if (repl->session) {
+                    session_evaluate(repl->session, repl->input, repl->current_ns);
+                } else {
+                    evaluate_source("text", repl->input, true, true, repl->current_ns, theme, true,
+                                    repl->session_id);
+                }
 
                 if (repl->session_id == 0) {
                     clear_int_handler();
@@ -206,6 +215,8 @@ bool process_line(repl_t *repl, char *input_line, bool split_on_newlines) {
                     free(repl->input);
                     return true;
                 }
+            } else if (repl->session) {
+                session_print(repl->session, "\n");
             } else {
                 engine_print("\n");
             }
@@ -218,7 +229,7 @@ bool process_line(repl_t *repl, char *input_line, bool split_on_newlines) {
 
             // Fetch the current namespace and use it to set the prompt
 
-            char *current_ns = get_current_ns();
+            char *current_ns = repl->session ? session_get_current_ns(repl->session) : get_current_ns();
             if (current_ns) {
                 free(repl->current_ns);
                 repl->current_ns = current_ns;
@@ -514,31 +525,39 @@ conn_data_cb_ret_t* socket_repl_data_arrived(char *data, int sock, void *state)
     int err = 0;
     bool exit = false;
 
-    if (data) {
-        repl_t *repl = state;
+    repl_t *repl = state;
 
+    if (data) {
         if (str_has_suffix(data, "\r\n") == 0) {
             data[strlen(data) - 2] = '\0';
         }
 
-        sock_to_write_to = sock;
-
-        pthread_mutex_lock(&repl_print_mutex);
+        if (repl->session) {
+            // The session's engine is its own, so it needn't wait for others
+            exit = process_line(repl, strdup(data), false);
+        } else {
+            sock_to_write_to = sock;
 
-        set_print_sender(&socket_sender);
+            pthread_mutex_lock(&repl_print_mutex);
 
-        exit = process_line(repl, strdup(data), false);
+            set_print_sender(&socket_sender);
 
-        set_print_sender(NULL);
-        sock_to_write_to = 0;
+            exit = process_line(repl, strdup(data), false);
 
-        pthread_mutex_unlock(&repl_print_mutex);
+            set_print_sender(NULL);
+            sock_to_write_to = 0;
 
+            pthread_mutex_unlock(&repl_print_mutex);
+        }
 
         if (!exit && repl->current_prompt != NULL) {
             err = write_to_socket(sock, repl->current_prompt);
         }
     } else {
+        if (repl && repl->session) {
+            session_release(repl->session);
+            repl->session = NULL;
+        }
         exit = true;
     }
 
@@ -554,6 +573,9 @@ accepted_conn_cb_ret_t* accepted_socket_repl_connection(int sock, void* state) {
     repl_t *repl = make_repl();
     repl->current_prompt = form_prompt(repl, false);
     repl->session_id = ++session_id_counter;
+    if (config.socket_repl_pool_size > 0) {
+        repl->session = session_acquire(repl->session_id, sock);
+    }
 
     int err = write_to_socket(sock, repl->current_prompt);
 
@@ -628,6 +650,13 @@ int run_repl() {
         if (err == -1) {
             engine_perror("Failed to set up socket REPL");
         } else {
+            if (config.socket_repl_pool_size > 0) {
+                err = session_pool_start(config.socket_repl_pool_size);
+                if (err) {
+                    engine_print_err_message("Failed to start socket REPL session engines", err);
+                }
+            }
+
             pthread_t thread;
             pthread_create(&thread, NULL, accept_connections, &socket_accept_data);
         }
@@ -0,0 +1,355 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <JavaScriptCore/JavaScript.h>
+
+#include "engine.h"
+#include "functions.h"
+#include "globals.h"
+#include "http.h"
+#include "jsc_utils.h"
+#include "session.h"
+#include "shell.h"
+#include "sockets.h"
+#include "str.h"
+#include "worker.h"
+
+// Each engine's context is created in a context group of its own, as is done
+// for workers: contexts in the same group share a virtual machine and its
+// lock, and so could not evaluate at the same time.
+//
+// Session engines only have the synchronous native functions; timers,
+// asynchronous I/O, sockets and workers call back into the main engine. The
+// native functions that use state shared with the main engine, such as the
+// classpath index and the compilation cache, are called with the eval lock
+// held. None of the natives registered here may keep values made in one
+// context for use in another, as each engine has a virtual machine of its
+// own.
+
+struct session {
+    JSGlobalContextRef context;
+    JSObjectRef execute_fn;
+    JSObjectRef is_readable_fn;
+    JSObjectRef get_current_ns_fn;
+    int session_id;
+    int sock;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static session_t **spares = NULL;
+static int num_spares = 0;
+static int pool_size = 0;
+static bool pool_failed = false;
+
+#define LOCKED_FUNCTION(name) \
+    static JSValueRef locked_##name(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, \
+                                    size_t argc, const JSValueRef args[], JSValueRef *exception) { \
+        acquire_eval_lock(); \
+        JSValueRef rv = name(ctx, function, thisObject, argc, args, exception); \
+        release_eval_lock(); \
+        return rv; \
+    }
+
+LOCKED_FUNCTION(function_load)
+LOCKED_FUNCTION(function_load_deps_cljs_files)
+LOCKED_FUNCTION(function_load_data_readers_files)
+LOCKED_FUNCTION(function_load_from_jar)
+LOCKED_FUNCTION(function_cache)
+LOCKED_FUNCTION(function_cache_put)
+LOCKED_FUNCTION(function_cache_get)
+LOCKED_FUNCTION(function_write_cache_manifest)
+
+static JSValueRef session_shellexec(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                    size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 6 && JSValueIsNumber(ctx, args[5])) {
+        JSStringRef message = JSStringCreateWithUTF8CString(
+                "Asynchronous shell commands are not available in session engines");
+        JSValueRef message_val = JSValueMakeString(ctx, message);
+        JSStringRelease(message);
+        *exception = JSObjectMakeError(ctx, 1, &message_val, NULL);
+        return JSValueMakeNull(ctx);
+    }
+    return function_shellexec(ctx, function, thisObject, argc, args, exception);
+}
+
+// Writes to the socket of the session that the context was acquired for, if
+// any, so that output while bootstrapping is discarded
+static JSValueRef session_print_fn(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                   size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1) {
+        JSValueRef sock = get_value_on_object(ctx, JSContextGetGlobalObject(ctx), "PLANCK_SESSION_SOCKET");
+        if (JSValueIsNumber(ctx, sock)) {
+            char *str = value_to_c_string_ext(ctx, args[0], true);
+            write_to_socket((int) JSValueToNumber(ctx, sock, NULL), str);
+            free(str);
+        }
+    }
+
+    return JSValueMakeNull(ctx);
+}
+
+static void register_session_functions(JSContextRef context) {
+    register_global_function(context, "PLANCK_CONSOLE_STDOUT", function_console_stdout);
+    register_global_function(context, "PLANCK_CONSOLE_STDERR", function_console_stderr);
+
+    register_global_function(context, "PLANCK_PRINT_FN", session_print_fn);
+    register_global_function(context, "PLANCK_PRINT_ERR_FN", session_print_fn);
+
+    register_global_function(context, "PLANCK_READ_FILE", function_read_file);
+    register_global_function(context, "PLANCK_LOAD", locked_function_load);
+    register_global_function(context, "PLANCK_BUNDLE_EXISTS", function_bundle_exists);
+    register_global_function(context, "PLANCK_RUNTIME_STATS", function_runtime_stats);
+    register_global_function(context, "PLANCK_LOAD_DEPS_CLJS_FILES", locked_function_load_deps_cljs_files);
+    register_global_function(context, "PLANCK_LOAD_DATA_READERS_FILES", locked_function_load_data_readers_files);
+    register_global_function(context, "PLANCK_LOAD_FROM_JAR", locked_function_load_from_jar);
+    register_global_function(context, "PLANCK_CACHE", locked_function_cache);
+    register_global_function(context, "PLANCK_CACHE_PUT", locked_function_cache_put);
+    register_global_function(context, "PLANCK_CACHE_GET", locked_function_cache_get);
+    register_global_function(context, "PLANCK_WRITE_CACHE_MANIFEST", locked_function_write_cache_manifest);
+
+    register_global_function(context, "PLANCK_EVAL", function_eval);
+
+    register_global_function(context, "PLANCK_GET_TERM_SIZE", function_get_term_size);
+
+    register_global_function(context, "PLANCK_EXIT_WITH_VALUE", function_exit_with_value);
+
+    register_global_function(context, "PLANCK_SHELL_SH", session_shellexec);
+
+    register_global_function(context, "PLANCK_RAW_READ_STDIN", function_raw_read_stdin);
+    register_global_function(context, "PLANCK_READ_LINES", function_read_lines);
+    register_global_function(context, "PLANCK_RAW_WRITE_STDOUT", function_raw_write_stdout);
+    register_global_function(context, "PLANCK_RAW_FLUSH_STDOUT", function_raw_flush_stdout);
+    register_global_function(context, "PLANCK_RAW_WRITE_STDERR", function_raw_write_stderr);
+    register_global_function(context, "PLANCK_RAW_FLUSH_STDERR", function_raw_flush_stderr);
+
+    register_global_function(context, "PLANCK_FILE_READER_OPEN", function_file_reader_open);
+    register_global_function(context, "PLANCK_FILE_READER_READ", function_file_reader_read);
+    register_global_function(context, "PLANCK_FILE_READER_CLOSE", function_file_reader_close);
+
+    register_global_function(context, "PLANCK_FILE_WRITER_OPEN", function_file_writer_open);
+    register_global_function(context, "PLANCK_FILE_WRITER_WRITE", function_file_writer_write);
+    register_global_function(context, "PLANCK_FILE_WRITER_FLUSH", function_file_writer_flush);
+    register_global_function(context, "PLANCK_FILE_WRITER_CLOSE", function_file_writer_close);
+
+    register_global_function(context, "PLANCK_FILE_INPUT_STREAM_OPEN", function_file_input_stream_open);
+    register_global_function(context, "PLANCK_FILE_INPUT_STREAM_READ", function_file_input_stream_read);
+    register_global_function(context, "PLANCK_FILE_INPUT_STREAM_CLOSE", function_file_input_stream_close);
+
+    register_global_function(context, "PLANCK_FILE_OUTPUT_STREAM_OPEN", function_file_output_stream_open);
+    register_global_function(context, "PLANCK_FILE_OUTPUT_STREAM_WRITE", function_file_output_stream_write);
+    register_global_function(context, "PLANCK_FILE_OUTPUT_STREAM_FLUSH", function_file_output_stream_flush);
+    register_global_function(context, "PLANCK_FILE_OUTPUT_STREAM_CLOSE", function_file_output_stream_close);
+
+    register_global_function(context, "PLANCK_MKDIRS", function_mkdirs);
+    register_global_function(context, "PLANCK_DELETE", function_delete_file);
+    register_global_function(context, "PLANCK_COPY", function_copy_file);
+    register_global_function(context, "PLANCK_COPY_TREE", function_copy_tree);
+
+    register_global_function(context, "PLANCK_LIST_FILES", function_list_files);
+    register_global_function(context, "PLANCK_WALK_OPEN", function_walk_open);
+    register_global_function(context, "PLANCK_WALK", function_walk);
+    register_global_function(context, "PLANCK_WALK_CLOSE", function_walk_close);
+
+    register_global_function(context, "PLANCK_IS_DIRECTORY", function_is_directory);
+
+    register_global_function(context, "PLANCK_FSTAT", function_fstat);
+    register_global_function(context, "PLANCK_FSTAT_MANY", function_fstat_many);
+
+    register_global_function(context, "PLANCK_MKTEMP", function_mktemp);
+
+    register_global_function(context, "PLANCK_REQUEST", function_http_request);
+
+    register_global_function(context, "PLANCK_READ_PASSWORD", function_read_password);
+
+    register_global_function(context, "PLANCK_HIGH_RES_TIMER", function_high_res_timer);
+
+    register_global_function(context, "PLANCK_SLEEP", function_sleep);
+
+    register_global_function(context, "PLANCK_GETENV", function_getenv);
+
+    register_global_function(context, "PLANCK_ISATTY", function_isatty);
+}
+
+// Calls the exported function ns/name, returning a description of the
+// exception it threw, if any, which the caller must free
+static char *call_exported(JSContextRef context, char *ns, char *name) {
+    JSValueRef ex = NULL;
+    JSObjectCallAsFunction(context, get_context_function(context, ns, name), JSContextGetGlobalObject(context),
+                           0, NULL, &ex);
+    if (ex == NULL) {
+        return NULL;
+    }
+    JSStringRef str = to_string(context, ex);
+    char *error = value_to_c_string(context, JSValueMakeString(context, str));
+    JSStringRelease(str);
+    return error;
+}
+
+// Initializes the context as do_engine_init does the main engine's for the
+// REPL, returning a description of what went wrong, if anything
+static char *bootstrap_session(JSGlobalContextRef context) {
+    char *error = worker_bootstrap(context);
+    if (error) {
+        return error;
+    }
+    init_goog_require(context);
+
+    evaluate_script(context, "var PLANCK_VERSION = \"" PLANCK_VERSION "\";", "<session>");
+    register_session_functions(context);
+
+    error = worker_evaluate(context,
+                            "goog.require('planck.repl');"
+                            "cljs.core.system_time = PLANCK_HIGH_RES_TIMER;"
+                            "cljs.core.set_print_fn_BANG_.call(null,PLANCK_PRINT_FN);"
+                            "cljs.core.set_print_err_fn_BANG_.call(null,PLANCK_PRINT_ERR_FN);"
+                            "cljs.core._STAR_print_newline_STAR_ = true;",
+                            "<session>");
+    if (error) {
+        return error;
+    }
+
+    init_planck_repl(context);
+
+    JSObjectRef execute_fn = get_context_function(context, "planck.repl", "execute");
+    execute_source(context, execute_fn, "text", (char *) repl_requires_source, true, false, "cljs.user", "dumb", 0);
+
+    error = worker_evaluate(context, "goog.provide('cljs.user'); goog.require('cljs.core');", "<session>");
+    if (!error) {
+        error = call_exported(context, "planck.repl", "init-data-readers");
+    }
+    if (!error) {
+        error = call_exported(context, "planck.repl", "maybe-load-user-file");
+    }
+    return error;
+}
+
+static session_t *create_session(char **error) {
+    JSGlobalContextRef context = JSGlobalContextCreate(NULL);
+    *error = bootstrap_session(context);
+    if (*error) {
+        JSGlobalContextRelease(context);
+        return NULL;
+    }
+
+    session_t *session = malloc(sizeof(session_t));
+    session->context = context;
+    session->execute_fn = get_context_function(context, "planck.repl", "execute");
+    session->is_readable_fn = get_context_function(context, "planck.repl", "is-readable?");
+    session->get_current_ns_fn = get_context_function(context, "planck.repl", "get-current-ns");
+    JSValueProtect(context, session->execute_fn);
+    JSValueProtect(context, session->is_readable_fn);
+    JSValueProtect(context, session->get_current_ns_fn);
+    session->session_id = 0;
+    session->sock = 0;
+    return session;
+}
+
+static void *fill_pool(void *arg) {
+    pthread_mutex_lock(&pool_lock);
+    while (!pool_failed) {
+        if (num_spares >= pool_size) {
+            pthread_cond_wait(&pool_cond, &pool_lock);
+            continue;
+        }
+
+        // Bootstrapping takes a while, so sessions may be taken meanwhile
+        pthread_mutex_unlock(&pool_lock);
+        char *error = NULL;
+        session_t *session = create_session(&error);
+        pthread_mutex_lock(&pool_lock);
+
+        if (session) {
+            spares[num_spares++] = session;
+        } else {
+            fprintf(stderr, "Could not bootstrap a session engine: %s\n", error);
+            free(error);
+            pool_failed = true;
+        }
+        pthread_cond_broadcast(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+int session_pool_start(int num_spare) {
+    pool_size = num_spare > 0 ? num_spare : 1;
+    spares = malloc(pool_size * sizeof(session_t *));
+    if (!spares) {
+        return ENOMEM;
+    }
+
+    pthread_attr_t attr;
+    int err = pthread_attr_init(&attr);
+    if (!err) {
+        err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        if (!err) {
+            err = pthread_create(&thread, &attr, fill_pool, NULL);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    if (err) {
+        pool_failed = true;
+    }
+    return err;
+}
+
+session_t *session_acquire(int session_id, int sock) {
+    pthread_mutex_lock(&pool_lock);
+    while (num_spares == 0 && !pool_failed && spares != NULL) {
+        pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+    session_t *session = NULL;
+    if (num_spares > 0) {
+        session = spares[--num_spares];
+        // Wakes the pool thread to bootstrap a replacement
+        pthread_cond_broadcast(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (session) {
+        session->session_id = session_id;
+        session->sock = sock;
+        JSStringRef name = JSStringCreateWithUTF8CString("PLANCK_SESSION_SOCKET");
+        JSObjectSetProperty(session->context, JSContextGetGlobalObject(session->context), name,
+                            JSValueMakeNumber(session->context, sock), kJSPropertyAttributeDontEnum, NULL);
+        JSStringRelease(name);
+    }
+    return session;
+}
+
+void session_release(session_t *session) {
+    JSValueUnprotect(session->context, session->execute_fn);
+    JSValueUnprotect(session->context, session->is_readable_fn);
+    JSValueUnprotect(session->context, session->get_current_ns_fn);
+    JSGlobalContextRelease(session->context);
+    free(session);
+}
+
+void session_evaluate(session_t *session, char *source, char *set_ns) {
+    execute_source(session->context, session->execute_fn, "text", source, true, true, set_ns, "dumb",
+                   session->session_id);
+}
+
+char *session_is_readable(session_t *session, char *expression) {
+    JSValueRef arguments[2];
+    arguments[0] = c_string_to_value(session->context, expression);
+    arguments[1] = c_string_to_value(session->context, "dumb");
+    JSValueRef result = JSObjectCallAsFunction(session->context, session->is_readable_fn,
+                                               JSContextGetGlobalObject(session->context), 2, arguments, NULL);
+    return value_to_c_string(session->context, result);
+}
+
+char *session_get_current_ns(session_t *session) {
+    JSValueRef result = JSObjectCallAsFunction(session->context, session->get_current_ns_fn,
+                                               JSContextGetGlobalObject(session->context), 0, NULL, NULL);
+    return value_to_c_string(session->context, result);
+}
+
+void session_print(session_t *session, const char *msg) {
+    write_to_socket(session->sock, msg);
+}
@@ -0,0 +1,33 @@
+#include <stdbool.h>
+
+// Session engines give each socket REPL session a JavaScript context of its
+// own, with planck.repl bootstrapped as it is for the main engine, so that
+// sessions can evaluate at the same time as each other and the main REPL.
+// Engines are bootstrapped ahead of time, on a thread of their own, so that
+// one is ready when a session starts.
+
+typedef struct session session_t;
+
+// Starts keeping num_spare engines bootstrapped for sessions to take. Returns
+// 0, or an error number if the thread doing so could not be started.
+int session_pool_start(int num_spare);
+
+// Takes an engine from the pool, waiting for one to be bootstrapped if none
+// is ready, for the session with session_id, whose output is written to sock.
+// Returns NULL if engines could not be bootstrapped.
+session_t *session_acquire(int session_id, int sock);
+
+// Releases the session's engine, after which session must not be used again.
+void session_release(session_t *session);
+
+// Evaluates the source text in the session, as evaluate_source does, printing
+// the results to the session's socket.
+void session_evaluate(session_t *session, char *source, char *set_ns);
+
+// As is_readable and get_current_ns, for the session.
+char *session_is_readable(session_t *session, char *expression);
+
+char *session_get_current_ns(session_t *session);
+
+// Writes msg to the session's socket.
+void session_print(session_t *session, const char *msg);
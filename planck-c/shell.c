@@ -16,6 +16,7 @@
 #include <poll.h>
 #include <sysexits.h>
 #include "engine.h"
+#include "event_loop.h"
 #include "jsc_utils.h"
 #include "tasks.h"
 #include "io.h"
@@ -213,6 +214,36 @@ void process_child_pipes(struct ThreadParams *params) {
     params->res.stderr = err_buf ? err_buf : strdup("");
 }
 
+// Calls back into JavaScript with the result of sh-async, on the event loop
+static void run_async_callback(void *data) {
+    struct ThreadParams *params = data;
+
+    JSValueRef args[1];
+    args[0] = result_to_object_ref(ctx, &params->res);
+    static JSObjectRef translate_async_result_fn = NULL;
+    if (!translate_async_result_fn) {
+        translate_async_result_fn = get_function("global", "translate_async_result");
+        JSValueProtect(ctx, translate_async_result_fn);
+    }
+    JSObjectRef result = (JSObjectRef) JSObjectCallAsFunction(ctx, translate_async_result_fn, NULL,
+                                                              1, args, NULL);
+
+    args[0] = JSValueMakeNumber(ctx, params->cb_idx);
+    static JSObjectRef do_async_sh_callback_fn = NULL;
+    if (!do_async_sh_callback_fn) {
+        do_async_sh_callback_fn = get_function("global", "do_async_sh_callback");
+        JSValueProtect(ctx, do_async_sh_callback_fn);
+    }
+    JSObjectCallAsFunction(ctx, do_async_sh_callback_fn, result, 1, args, NULL);
+
+    free(params);
+
+    int err = signal_task_complete();
+    if (err) {
+        engine_print_err_message("shell signal_task_complete", err);
+    }
+}
+
 static struct SystemResult *wait_for_child(struct ThreadParams *params) {
 
     params->res.status = 0;
@@ -240,31 +271,7 @@ static struct SystemResult *wait_for_child(struct ThreadParams *params) {
     if (params->cb_idx == -1) {
         return &params->res;
     } else {
-        JSValueRef args[1];
-        args[0] = result_to_object_ref(ctx, &params->res);
-        static JSObjectRef translate_async_result_fn = NULL;
-        if (!translate_async_result_fn) {
-            translate_async_result_fn = get_function("global", "translate_async_result");
-            JSValueProtect(ctx, translate_async_result_fn);
-        }
-        JSObjectRef result = (JSObjectRef) JSObjectCallAsFunction(ctx, translate_async_result_fn, NULL,
-                                                                  1, args, NULL);
-
-        args[0] = JSValueMakeNumber(ctx, params->cb_idx);
-        static JSObjectRef do_async_sh_callback_fn = NULL;
-        if (!do_async_sh_callback_fn) {
-            do_async_sh_callback_fn = get_function("global", "do_async_sh_callback");
-            JSValueProtect(ctx, do_async_sh_callback_fn);
-        }
-        JSObjectCallAsFunction(ctx, do_async_sh_callback_fn, result, 1, args, NULL);
-
-        free(params);
-
-        int err = signal_task_complete();
-        if (err) {
-            engine_print_err_message("shell signal_task_complete", err);
-        }
-
+        event_loop_post(run_async_callback, params);
         return NULL;
     }
 }
@@ -378,7 +385,7 @@ static JSValueRef system_call(JSContextRef ctx, char **cmd, char *in_str, char *
     } else if (pid == 0) {
         if (dir) {
             if (chdir(dir) == -1) {
-                exit(1);
+                _exit(1);
             }
         }
         preopen(out[0], STDIN_FILENO);
@@ -396,12 +403,13 @@ static JSValueRef system_call(JSContextRef ctx, char **cmd, char *in_str, char *
         } else {
             execvp(cmd[0], cmd);
         }
+        // _exit, so as to not flush output buffered by the parent
         if (errno == EACCES || errno == EPERM) {
-            exit(126);
+            _exit(126);
         } else if (errno == ENOENT) {
-            exit(127);
+            _exit(127);
         } else {
-            exit(1);
+            _exit(1);
         }
     } else {
         struct ThreadParams *params = NULL;
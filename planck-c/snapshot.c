@@ -0,0 +1,381 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <JavaScriptCore/JavaScript.h>
+
+#include "globals.h"
+#include "io.h"
+#include "jsc_utils.h"
+#include "snapshot.h"
+#include "strmap.h"
+
+// A snapshot file is a sequence of text headers, each followed by a payload:
+//
+//   PLANCK-SNAPSHOT <format> <planck-version> <clojurescript-version>
+//   paths <segment> <count>       one preloaded import path per line
+//   image <segment> <length>      the combined script for the segment
+//   script <path> <length>        a script imported after the segments
+//   resource <path> <length>      a bundled resource loaded during init
+//
+// JavaScriptCore offers no way to serialize a heap, so a snapshot captures
+// the evaluated sources rather than the resulting engine state.
+
+#define SNAPSHOT_FORMAT 1
+
+struct snapshot_entry {
+    char *segment;
+    char *path;
+    char *data;
+    size_t length;
+    bool preloaded;
+};
+
+struct snapshot_entries {
+    size_t count;
+    size_t capacity;
+    struct snapshot_entry *entries;
+    // Maps each path to one more than the index of its first entry, covering
+    // the first num_indexed entries
+    strmap_t *index;
+    size_t num_indexed;
+};
+
+static char *snapshot_buffer = NULL;
+static struct snapshot_entries images;
+static struct snapshot_entries scripts;
+static struct snapshot_entries resources;
+static struct snapshot_entries preloaded_paths;
+
+static bool recording = false;
+static char *current_segment = NULL;
+
+static struct snapshot_entry *add_entry(struct snapshot_entries *entries) {
+    if (entries->count == entries->capacity) {
+        entries->capacity = entries->capacity ? 2 * entries->capacity : 64;
+        entries->entries = realloc(entries->entries, entries->capacity * sizeof(struct snapshot_entry));
+    }
+    struct snapshot_entry *entry = &entries->entries[entries->count++];
+    memset(entry, 0, sizeof(struct snapshot_entry));
+    return entry;
+}
+
+static struct snapshot_entry *find_entry(struct snapshot_entries *entries, const char *path) {
+    // Entries added since the last lookup are indexed first; indices rather
+    // than pointers are kept, as the entries move when they grow
+    if (entries->index == NULL) {
+        entries->index = strmap_create(entries->count > 64 ? 2 * entries->count : 128);
+    }
+    for (; entries->num_indexed < entries->count; entries->num_indexed++) {
+        const char *key = entries->entries[entries->num_indexed].path;
+        if (!strmap_contains(entries->index, key)) {
+            strmap_put(entries->index, key, (void *) (uintptr_t) (entries->num_indexed + 1));
+        }
+    }
+
+    uintptr_t i = (uintptr_t) strmap_get(entries->index, path);
+    return i ? &entries->entries[i - 1] : NULL;
+}
+
+static void free_entries(struct snapshot_entries *entries) {
+    free(entries->entries);
+    if (entries->index != NULL) {
+        strmap_free(entries->index);
+    }
+    memset(entries, 0, sizeof(struct snapshot_entries));
+}
+
+static char *header_line(char **cursor, char *end) {
+    char *line = *cursor;
+    char *newline = memchr(line, '\n', end - line);
+    if (newline == NULL) {
+        return NULL;
+    }
+    *newline = '\0';
+    *cursor = newline + 1;
+    return line;
+}
+
+static int parse_snapshot(char *buffer, size_t length) {
+    char *cursor = buffer;
+    char *end = buffer + length;
+
+    char *header = header_line(&cursor, end);
+    if (header == NULL) {
+        return -1;
+    }
+    char expected[256];
+    snprintf(expected, 256, "PLANCK-SNAPSHOT %d %s %s", SNAPSHOT_FORMAT, PLANCK_VERSION,
+             config.clojurescript_version);
+    if (strcmp(header, expected) != 0) {
+        return -1;
+    }
+
+    char *line;
+    while ((line = header_line(&cursor, end)) != NULL) {
+        char *saveptr = NULL;
+        char *kind = strtok_r(line, " ", &saveptr);
+        char *name = strtok_r(NULL, " ", &saveptr);
+        char *size = strtok_r(NULL, " ", &saveptr);
+        if (kind == NULL || name == NULL || size == NULL) {
+            return -1;
+        }
+        size_t n = (size_t) strtoull(size, NULL, 10);
+
+        if (strcmp(kind, "paths") == 0) {
+            size_t i;
+            for (i = 0; i < n; i++) {
+                char *path = header_line(&cursor, end);
+                if (path == NULL) {
+                    return -1;
+                }
+                struct snapshot_entry *entry = add_entry(&preloaded_paths);
+                entry->segment = name;
+                entry->path = path;
+            }
+            continue;
+        }
+
+        if (n + 1 > end - cursor) {
+            return -1;
+        }
+        struct snapshot_entries *entries = NULL;
+        if (strcmp(kind, "image") == 0) {
+            entries = &images;
+        } else if (strcmp(kind, "script") == 0) {
+            entries = &scripts;
+        } else if (strcmp(kind, "resource") == 0) {
+            entries = &resources;
+        } else {
+            return -1;
+        }
+        struct snapshot_entry *entry = add_entry(entries);
+        entry->segment = name;
+        entry->path = name;
+        entry->data = cursor;
+        entry->length = n;
+        cursor[n] = '\0';
+        cursor += n + 1;
+    }
+
+    return 0;
+}
+
+int snapshot_load(const char *path) {
+    char *buffer = get_contents((char *) path, NULL);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    if (parse_snapshot(buffer, strlen(buffer)) < 0) {
+        free_entries(&images);
+        free_entries(&scripts);
+        free_entries(&resources);
+        free_entries(&preloaded_paths);
+        free(buffer);
+        errno = EINVAL;
+        return -1;
+    }
+
+    snapshot_buffer = buffer;
+    return 0;
+}
+
+bool snapshot_loaded() {
+    return snapshot_buffer != NULL;
+}
+
+void snapshot_start_recording() {
+    recording = true;
+}
+
+bool snapshot_recording() {
+    return recording;
+}
+
+void snapshot_begin_segment(const char *name) {
+    free(current_segment);
+    current_segment = strdup(name);
+}
+
+void snapshot_end_segment() {
+    free(current_segment);
+    current_segment = NULL;
+}
+
+// Scripts are recorded when their evaluation starts, not when it finishes, so
+// that a script imported from within another (as goog/base.js does with
+// goog/deps.js) follows its importer in the combined image.
+
+void snapshot_record_script(const char *path, const char *source) {
+    if (!recording) {
+        return;
+    }
+    struct snapshot_entries *entries = current_segment ? &images : &scripts;
+    struct snapshot_entry *entry = add_entry(entries);
+    entry->segment = current_segment ? strdup(current_segment) : NULL;
+    entry->path = strdup(path);
+    entry->length = strlen(source);
+    entry->data = malloc(entry->length + 1);
+    memcpy(entry->data, source, entry->length + 1);
+}
+
+void snapshot_record_resource(const char *path, const char *contents) {
+    if (!recording || find_entry(&resources, path)) {
+        return;
+    }
+    struct snapshot_entry *entry = add_entry(&resources);
+    entry->path = strdup(path);
+    entry->length = strlen(contents);
+    entry->data = malloc(entry->length + 1);
+    memcpy(entry->data, contents, entry->length + 1);
+}
+
+static bool write_segment(FILE *f, const char *segment) {
+    size_t i;
+    size_t count = 0;
+    size_t length = 0;
+    for (i = 0; i < images.count; i++) {
+        if (strcmp(images.entries[i].segment, segment) == 0) {
+            count++;
+            length += images.entries[i].length + 3;
+        }
+    }
+
+    fprintf(f, "paths %s %zu\n", segment, count);
+    for (i = 0; i < images.count; i++) {
+        if (strcmp(images.entries[i].segment, segment) == 0) {
+            fprintf(f, "%s\n", images.entries[i].path);
+        }
+    }
+
+    // The leading statement keeps a "use strict" directive at the top of the
+    // first script from applying to the whole image.
+    const char *prologue = "void 0;\n";
+    fprintf(f, "image %s %zu\n%s", segment, strlen(prologue) + length, prologue);
+    for (i = 0; i < images.count; i++) {
+        if (strcmp(images.entries[i].segment, segment) == 0) {
+            fwrite(images.entries[i].data, 1, images.entries[i].length, f);
+            fputs("\n;\n", f);
+        }
+    }
+    fputs("\n", f);
+
+    return ferror(f) == 0;
+}
+
+static void write_entries(FILE *f, const char *kind, struct snapshot_entries *entries) {
+    size_t i;
+    for (i = 0; i < entries->count; i++) {
+        fprintf(f, "%s %s %zu\n", kind, entries->entries[i].path, entries->entries[i].length);
+        fwrite(entries->entries[i].data, 1, entries->entries[i].length, f);
+        fputs("\n", f);
+    }
+}
+
+int snapshot_write(const char *path) {
+    recording = false;
+
+    char *tmp_path = malloc(strlen(path) + 5);
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        free(tmp_path);
+        return -1;
+    }
+
+    fprintf(f, "PLANCK-SNAPSHOT %d %s %s\n", SNAPSHOT_FORMAT, PLANCK_VERSION, config.clojurescript_version);
+
+    size_t i;
+    const char *last_segment = NULL;
+    for (i = 0; i < images.count; i++) {
+        const char *segment = images.entries[i].segment;
+        if (last_segment == NULL || strcmp(last_segment, segment) != 0) {
+            write_segment(f, segment);
+            last_segment = segment;
+        }
+    }
+    write_entries(f, "script", &scripts);
+    write_entries(f, "resource", &resources);
+
+    bool failed = ferror(f) != 0;
+    if (fclose(f) != 0 || failed || rename(tmp_path, path) != 0) {
+        int saved_errno = errno;
+        unlink(tmp_path);
+        free(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+
+    free(tmp_path);
+    return 0;
+}
+
+bool snapshot_replay_segment(JSContextRef ctx, const char *name) {
+    if (!snapshot_buffer) {
+        return false;
+    }
+
+    struct snapshot_entry *image = NULL;
+    size_t i;
+    for (i = 0; i < images.count; i++) {
+        if (strcmp(images.entries[i].segment, name) == 0) {
+            image = &images.entries[i];
+            break;
+        }
+    }
+    if (image == NULL) {
+        return false;
+    }
+
+    // Mark the imports the image covers before evaluating it, since the
+    // scripts in it may themselves request imports.
+    for (i = 0; i < preloaded_paths.count; i++) {
+        if (strcmp(preloaded_paths.entries[i].segment, name) == 0) {
+            preloaded_paths.entries[i].preloaded = true;
+        }
+    }
+
+    char source[256];
+    snprintf(source, 256, "<snapshot:%s>", name);
+    JSStringRef script_ref = JSStringCreateWithUTF8CString(image->data);
+    JSStringRef source_ref = JSStringCreateWithUTF8CString(source);
+    JSValueRef ex = NULL;
+    JSEvaluateScript(ctx, script_ref, NULL, source_ref, 0, &ex);
+    JSStringRelease(script_ref);
+    JSStringRelease(source_ref);
+
+    if (ex) {
+        print_value("Error replaying startup snapshot: ", ctx, ex);
+        exit(1);
+    }
+
+    return true;
+}
+
+// A preloaded path satisfies only the first import request for it; later
+// requests (such as those made by a :reload) load the script afresh.
+
+bool snapshot_claim_preloaded(const char *path) {
+    // Each import is recorded once, so a path is in at most one segment
+    struct snapshot_entry *entry = find_entry(&preloaded_paths, path);
+    if (entry != NULL && entry->preloaded) {
+        entry->preloaded = false;
+        return true;
+    }
+    return false;
+}
+
+char *snapshot_get_script(const char *path) {
+    struct snapshot_entry *entry = find_entry(&scripts, path);
+    return entry ? strdup(entry->data) : NULL;
+}
+
+char *snapshot_get_resource(const char *path) {
+    struct snapshot_entry *entry = find_entry(&resources, path);
+    return entry ? strdup(entry->data) : NULL;
+}
@@ -0,0 +1,34 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <JavaScriptCore/JavaScript.h>
+
+// Startup snapshots: a recording of the bundled JavaScript evaluated and the
+// bundled resources loaded while the engine initializes, replayed on later
+// launches as one combined script per bootstrap segment.
+
+int snapshot_load(const char *path);
+
+bool snapshot_loaded();
+
+void snapshot_start_recording();
+
+bool snapshot_recording();
+
+void snapshot_begin_segment(const char *name);
+
+void snapshot_end_segment();
+
+void snapshot_record_script(const char *path, const char *source);
+
+void snapshot_record_resource(const char *path, const char *contents);
+
+int snapshot_write(const char *path);
+
+bool snapshot_replay_segment(JSContextRef ctx, const char *name);
+
+bool snapshot_claim_preloaded(const char *path);
+
+char *snapshot_get_script(const char *path);
+
+char *snapshot_get_resource(const char *path);
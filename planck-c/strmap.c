@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "strmap.h"
+
+struct strmap_entry {
+    const char *key;
+    uint64_t hash;
+    void *value;
+};
+
+struct strmap {
+    size_t count;
+    size_t capacity;
+    struct strmap_entry *entries;
+};
+
+// 64-bit FNV-1a
+uint64_t strmap_hash(const char *key) {
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char *p;
+    for (p = (const unsigned char *) key; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+strmap_t *strmap_create(size_t initial_capacity) {
+    size_t capacity = 16;
+    while (capacity < 2 * initial_capacity) {
+        capacity *= 2;
+    }
+
+    strmap_t *map = malloc(sizeof(strmap_t));
+    map->count = 0;
+    map->capacity = capacity;
+    map->entries = calloc(capacity, sizeof(struct strmap_entry));
+    return map;
+}
+
+void strmap_free(strmap_t *map) {
+    if (map != NULL) {
+        free(map->entries);
+        free(map);
+    }
+}
+
+static struct strmap_entry *find_slot(struct strmap_entry *entries, size_t capacity, const char *key, uint64_t hash) {
+    size_t mask = capacity - 1;
+    size_t i = (size_t) hash & mask;
+    while (entries[i].key != NULL) {
+        if (entries[i].hash == hash && strcmp(entries[i].key, key) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &entries[i];
+}
+
+static void grow(strmap_t *map) {
+    size_t capacity = 2 * map->capacity;
+    struct strmap_entry *entries = calloc(capacity, sizeof(struct strmap_entry));
+
+    size_t i;
+    for (i = 0; i < map->capacity; i++) {
+        struct strmap_entry *entry = &map->entries[i];
+        if (entry->key != NULL) {
+            *find_slot(entries, capacity, entry->key, entry->hash) = *entry;
+        }
+    }
+
+    free(map->entries);
+    map->entries = entries;
+    map->capacity = capacity;
+}
+
+void *strmap_get(strmap_t *map, const char *key) {
+    struct strmap_entry *entry = find_slot(map->entries, map->capacity, key, strmap_hash(key));
+    return entry->key != NULL ? entry->value : NULL;
+}
+
+bool strmap_contains(strmap_t *map, const char *key) {
+    return find_slot(map->entries, map->capacity, key, strmap_hash(key))->key != NULL;
+}
+
+void strmap_put(strmap_t *map, const char *key, void *value) {
+    // Keep the load factor at or below one half
+    if (2 * (map->count + 1) > map->capacity) {
+        grow(map);
+    }
+
+    uint64_t hash = strmap_hash(key);
+    struct strmap_entry *entry = find_slot(map->entries, map->capacity, key, hash);
+    if (entry->key == NULL) {
+        entry->key = key;
+        entry->hash = hash;
+        map->count++;
+    }
+    entry->value = value;
+}
+
+size_t strmap_count(strmap_t *map) {
+    return map->count;
+}
+
+void strmap_each(strmap_t *map, void (*fn)(const char *key, void *value, void *data), void *data) {
+    size_t i;
+    for (i = 0; i < map->capacity; i++) {
+        if (map->entries[i].key != NULL) {
+            fn(map->entries[i].key, map->entries[i].value, data);
+        }
+    }
+}
@@ -0,0 +1,25 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A growable open-addressing hash map from strings to pointers. Keys are not
+// copied: they must outlive their entries in the map.
+
+typedef struct strmap strmap_t;
+
+strmap_t *strmap_create(size_t initial_capacity);
+
+void strmap_free(strmap_t *map);
+
+void *strmap_get(strmap_t *map, const char *key);
+
+bool strmap_contains(strmap_t *map, const char *key);
+
+void strmap_put(strmap_t *map, const char *key, void *value);
+
+size_t strmap_count(strmap_t *map);
+
+// Calls fn for each entry, in no particular order
+void strmap_each(strmap_t *map, void (*fn)(const char *key, void *value, void *data), void *data);
+
+uint64_t strmap_hash(const char *key);
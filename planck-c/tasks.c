@@ -1,11 +1,12 @@
 #include <pthread.h>
+#include "event_loop.h"
 #include "tasks.h"
 
 static int tasks_outstanding = 0;
 pthread_mutex_t tasks_complete_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t tasks_complete_cond = PTHREAD_COND_INITIALIZER;
 
-int block_until_tasks_complete() {
+static int wait_for_tasks() {
     int err = pthread_mutex_lock(&tasks_complete_lock);
     if (err) return err;
 
@@ -20,6 +21,23 @@ int block_until_tasks_complete() {
     return pthread_mutex_unlock(&tasks_complete_lock);
 }
 
+// Runs until the event loop is idle: until no tasks are outstanding and
+// nothing posted to the loop is left to run (which could start more tasks)
+int block_until_tasks_complete() {
+    for (;;) {
+        int err = wait_for_tasks();
+        if (err) return err;
+
+        event_loop_flush();
+
+        err = pthread_mutex_lock(&tasks_complete_lock);
+        if (err) return err;
+        int outstanding = tasks_outstanding;
+        err = pthread_mutex_unlock(&tasks_complete_lock);
+        if (err || !outstanding) return err;
+    }
+}
+
 int signal_task_started() {
     int err = pthread_mutex_lock(&tasks_complete_lock);
     if (err) return err;
@@ -1,70 +1,300 @@
-#include <stddef.h>
-#include <time.h>
+#include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <errno.h>
+#include <time.h>
+
+#include "clock.h"
 #include "timers.h"
-#include "engine.h"
-#include "tasks.h"
 
-struct timer_data_t {
-    long millis;
+// All timers are run by a single thread, which sleeps until the earliest
+// deadline in a binary min-heap. Each timer occupies a slot, and its id
+// combines the slot's index with a generation that is advanced whenever the
+// slot is reused, so that stale ids are recognized. Cancelling a timer only
+// marks its slot; cancelled timers are dropped when they reach the top of the
+// heap, or all at once when they come to outnumber the live ones.
+
+#define SLOT_INDEX_BITS 24
+#define MAX_SLOTS (1ul << SLOT_INDEX_BITS)
+// Keeps ids exactly representable as JavaScript numbers
+#define MAX_GENERATION ((1ul << (53 - SLOT_INDEX_BITS)) - 1)
+#define MIN_COMPACT_SIZE 64
+
+struct timer_slot {
+    uint64_t deadline;
+    uint64_t sequence;
     timer_callback_t timer_callback;
     void *data;
+    unsigned long generation;
+    bool cancelled;
+    // The next free slot, when this one is free
+    size_t next_free;
 };
 
-void *timer_thread(void *data) {
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static bool thread_started = false;
 
-    struct timer_data_t *timer_data = data;
+static struct timer_slot *slots = NULL;
+static size_t num_slots = 0;
+static size_t free_slot = SIZE_MAX;
 
-    struct timespec t;
-    t.tv_sec = timer_data->millis / 1000;
-    t.tv_nsec = 1000 * 1000 * (timer_data->millis % 1000);
-    if (t.tv_sec == 0 && t.tv_nsec == 0) {
-        t.tv_nsec = 1; /* Evidently needed on Ubuntu 14.04 */
+// Indexes into slots, ordered by deadline and then by sequence, so that
+// timers with the same deadline run in the order they were started
+static size_t *heap = NULL;
+static size_t heap_size = 0;
+static size_t heap_capacity = 0;
+static size_t num_cancelled = 0;
+static uint64_t next_sequence = 0;
+
+static unsigned long slot_id(size_t slot) {
+    return (slots[slot].generation << SLOT_INDEX_BITS) | slot;
+}
+
+static bool earlier(size_t a, size_t b) {
+    if (slots[a].deadline != slots[b].deadline) {
+        return slots[a].deadline < slots[b].deadline;
+    }
+    return slots[a].sequence < slots[b].sequence;
+}
+
+static void sift_up(size_t i) {
+    size_t slot = heap[i];
+    while (i > 0 && earlier(slot, heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
     }
+    heap[i] = slot;
+}
 
-    int err;
-    while ((err = nanosleep(&t, &t)) && errno == EINTR) {}
-    if (err) {
-        free(data);
-        engine_perror("timer nanosleep");
-        return NULL;
+static void sift_down(size_t i) {
+    size_t slot = heap[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= heap_size) {
+            break;
+        }
+        if (child + 1 < heap_size && earlier(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!earlier(heap[child], slot)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
     }
+    heap[i] = slot;
+}
 
-    timer_data->timer_callback(timer_data->data);
+static void release_slot(size_t slot) {
+    slots[slot].generation = slots[slot].generation == MAX_GENERATION ? 1 : slots[slot].generation + 1;
+    slots[slot].next_free = free_slot;
+    free_slot = slot;
+}
 
-    free(data);
+static void pop_heap() {
+    heap[0] = heap[--heap_size];
+    if (heap_size > 0) {
+        sift_down(0);
+    }
+}
 
-    return NULL;
+// Drops all of the cancelled timers from the heap
+static void compact_heap() {
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i < heap_size; i++) {
+        if (slots[heap[i]].cancelled) {
+            release_slot(heap[i]);
+        } else {
+            heap[n++] = heap[i];
+        }
+    }
+    heap_size = n;
+    num_cancelled = 0;
+    for (i = heap_size / 2; i-- > 0;) {
+        sift_down(i);
+    }
 }
 
-int start_timer(long millis, timer_callback_t timer_callback, void *data) {
+// Waits on timer_cond, with the lock held, until deadline at the latest
+static void wait_until(uint64_t deadline) {
+#ifdef __APPLE__
+    uint64_t now = system_time();
+    uint64_t delay = deadline > now ? deadline - now : 0;
+    struct timespec t;
+    t.tv_sec = delay / 1000000000;
+    t.tv_nsec = delay % 1000000000;
+    pthread_cond_timedwait_relative_np(&timer_cond, &timer_lock, &t);
+#else
+    struct timespec t;
+    t.tv_sec = deadline / 1000000000;
+    t.tv_nsec = deadline % 1000000000;
+    pthread_cond_timedwait(&timer_cond, &timer_lock, &t);
+#endif
+}
 
-    struct timer_data_t *timer_data = malloc(sizeof(struct timer_data_t));
-    if (!timer_data) return -1;
+static void *timer_thread(void *arg) {
+    pthread_mutex_lock(&timer_lock);
+    for (;;) {
+        if (heap_size == 0) {
+            pthread_cond_wait(&timer_cond, &timer_lock);
+            continue;
+        }
 
-    timer_data->millis = millis;
-    timer_data->timer_callback = timer_callback;
-    timer_data->data = data;
+        size_t slot = heap[0];
+        if (slots[slot].cancelled) {
+            pop_heap();
+            num_cancelled--;
+            release_slot(slot);
+            continue;
+        }
 
-    pthread_attr_t attr;
-    int err = pthread_attr_init(&attr);
+        if (slots[slot].deadline > system_time()) {
+            wait_until(slots[slot].deadline);
+            continue;
+        }
+
+        timer_callback_t timer_callback = slots[slot].timer_callback;
+        void *data = slots[slot].data;
+        pop_heap();
+        release_slot(slot);
+
+        // Callbacks may start timers of their own
+        pthread_mutex_unlock(&timer_lock);
+        timer_callback(data);
+        pthread_mutex_lock(&timer_lock);
+    }
+    return NULL;
+}
+
+// Called with the lock held
+static int start_thread() {
+    pthread_condattr_t cond_attr;
+    int err = pthread_condattr_init(&cond_attr);
     if (err) {
-        free(timer_data);
         return err;
     }
-
-    err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+#ifndef __APPLE__
+    // Deadlines are measured on the monotonic clock
+    err = pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+#endif
+    if (!err) {
+        err = pthread_cond_init(&timer_cond, &cond_attr);
+    }
+    pthread_condattr_destroy(&cond_attr);
     if (err) {
-        free(timer_data);
         return err;
     }
 
-    pthread_t thread;
-    err = pthread_create(&thread, &attr, timer_thread, timer_data);
+    pthread_attr_t attr;
+    err = pthread_attr_init(&attr);
+    if (!err) {
+        err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        if (!err) {
+            err = pthread_create(&thread, &attr, timer_thread, NULL);
+        }
+        pthread_attr_destroy(&attr);
+    }
     if (err) {
-        free(timer_data);
+        pthread_cond_destroy(&timer_cond);
+    } else {
+        thread_started = true;
     }
     return err;
 }
+
+// Called with the lock held
+static int allocate_slot(size_t *slot) {
+    if (free_slot == SIZE_MAX) {
+        if (num_slots == MAX_SLOTS) {
+            return EAGAIN;
+        }
+        size_t new_num_slots = num_slots == 0 ? 64 : num_slots * 2;
+        if (new_num_slots > MAX_SLOTS) {
+            new_num_slots = MAX_SLOTS;
+        }
+        struct timer_slot *new_slots = realloc(slots, new_num_slots * sizeof(struct timer_slot));
+        if (!new_slots) {
+            return ENOMEM;
+        }
+        slots = new_slots;
+        while (num_slots < new_num_slots) {
+            slots[num_slots].generation = 1;
+            release_slot(num_slots++);
+        }
+    }
+
+    if (heap_size == heap_capacity) {
+        size_t new_capacity = heap_capacity == 0 ? 64 : heap_capacity * 2;
+        size_t *new_heap = realloc(heap, new_capacity * sizeof(size_t));
+        if (!new_heap) {
+            return ENOMEM;
+        }
+        heap = new_heap;
+        heap_capacity = new_capacity;
+    }
+
+    *slot = free_slot;
+    free_slot = slots[free_slot].next_free;
+    return 0;
+}
+
+int schedule_timer(long millis, timer_callback_t timer_callback, void *data, unsigned long *id) {
+    pthread_mutex_lock(&timer_lock);
+
+    size_t slot;
+    int err = thread_started ? 0 : start_thread();
+    if (!err) {
+        err = allocate_slot(&slot);
+    }
+    if (err) {
+        pthread_mutex_unlock(&timer_lock);
+        return err;
+    }
+
+    slots[slot].deadline = system_time() + (millis > 0 ? (uint64_t) millis * 1000000 : 0);
+    slots[slot].sequence = next_sequence++;
+    slots[slot].timer_callback = timer_callback;
+    slots[slot].data = data;
+    slots[slot].cancelled = false;
+    if (id) {
+        *id = slot_id(slot);
+    }
+
+    heap[heap_size] = slot;
+    sift_up(heap_size++);
+    // Only a new earliest deadline changes how long the thread should sleep
+    if (heap[0] == slot) {
+        pthread_cond_signal(&timer_cond);
+    }
+
+    pthread_mutex_unlock(&timer_lock);
+    return 0;
+}
+
+int start_timer(long millis, timer_callback_t timer_callback, void *data) {
+    return schedule_timer(millis, timer_callback, data, NULL);
+}
+
+bool cancel_timer(unsigned long id, void **data) {
+    size_t slot = id & (MAX_SLOTS - 1);
+    bool cancelled = false;
+
+    pthread_mutex_lock(&timer_lock);
+    if (slot < num_slots && slot_id(slot) == id && !slots[slot].cancelled) {
+        slots[slot].cancelled = true;
+        num_cancelled++;
+        cancelled = true;
+        if (data) {
+            *data = slots[slot].data;
+        }
+        if (num_cancelled > heap_size / 2 && heap_size >= MIN_COMPACT_SIZE) {
+            compact_heap();
+        }
+    }
+    pthread_mutex_unlock(&timer_lock);
+
+    return cancelled;
+}
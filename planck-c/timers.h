@@ -1,3 +1,18 @@
+#include <stdbool.h>
+
+// Timers are run, one after another, on a single thread that is started on
+// first use, so callbacks should hand off any lengthy work.
+
 typedef void (*timer_callback_t)(void *data);
 
+// Arranges for timer_callback to be called with data after millis. Returns
+// 0, or an error number if the timer could not be started.
 int start_timer(long millis, timer_callback_t timer_callback, void *data);
+
+// Starts a timer as start_timer does, setting *id (if id is not NULL) to a
+// nonzero id for it, which fits in 53 bits, before the timer can run.
+int schedule_timer(long millis, timer_callback_t timer_callback, void *data, unsigned long *id);
+
+// Cancels the timer with id, returning whether it had yet to run, in which
+// case *data (if data is not NULL) is set to the data it was started with.
+bool cancel_timer(unsigned long id, void **data);
@@ -0,0 +1,891 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "walk.h"
+
+struct walk_entry {
+    // The offset of the entry's name in the directory's names
+    size_t name;
+    walk_type_t type;
+};
+
+// A directory being walked, whose entries are read in full when it is
+// reached, so that no descriptor is held open between calls to walk_next
+struct walk_dir {
+    char *names;
+    struct walk_entry *entries;
+    size_t num_entries;
+    size_t next;
+    // The length of the directory's path, which is a prefix of walker->path
+    size_t path_len;
+    int depth;
+};
+
+struct dir_id {
+    dev_t dev;
+    ino_t ino;
+    bool used;
+};
+
+// The directories walked, when following links, in an open-addressed hash
+// table whose capacity is a power of two
+struct dir_set {
+    struct dir_id *ids;
+    size_t size;
+    size_t capacity;
+};
+
+struct walker {
+    char *root;
+    int max_depth;
+    char *glob;
+    bool follow_links;
+    bool started;
+
+    struct walk_dir *stack;
+    size_t stack_size;
+    size_t stack_capacity;
+
+    char *path;
+    size_t path_capacity;
+
+    struct dir_set visited;
+
+    struct parallel_walk *parallel;
+};
+
+static const char *type_names[WALK_NUM_TYPES] = {
+        "unknown",
+        "file",
+        "directory",
+        "symbolic-link",
+        "socket",
+        "fifo",
+        "character-special",
+        "block-special"
+};
+
+const char *walk_type_name(walk_type_t type) {
+    return type_names[type];
+}
+
+static walk_type_t mode_to_type(mode_t mode) {
+    if (S_ISDIR(mode)) {
+        return WALK_DIRECTORY;
+    } else if (S_ISREG(mode)) {
+        return WALK_FILE;
+    } else if (S_ISLNK(mode)) {
+        return WALK_SYMBOLIC_LINK;
+    } else if (S_ISSOCK(mode)) {
+        return WALK_SOCKET;
+    } else if (S_ISFIFO(mode)) {
+        return WALK_FIFO;
+    } else if (S_ISCHR(mode)) {
+        return WALK_CHARACTER_SPECIAL;
+    } else if (S_ISBLK(mode)) {
+        return WALK_BLOCK_SPECIAL;
+    }
+    return WALK_UNKNOWN;
+}
+
+static walk_type_t d_type_to_type(unsigned char d_type) {
+    switch (d_type) {
+        case DT_DIR:
+            return WALK_DIRECTORY;
+        case DT_REG:
+            return WALK_FILE;
+        case DT_LNK:
+            return WALK_SYMBOLIC_LINK;
+        case DT_SOCK:
+            return WALK_SOCKET;
+        case DT_FIFO:
+            return WALK_FIFO;
+        case DT_CHR:
+            return WALK_CHARACTER_SPECIAL;
+        case DT_BLK:
+            return WALK_BLOCK_SPECIAL;
+        default:
+            return WALK_UNKNOWN;
+    }
+}
+
+// Stats name in the directory dir_fd, following links if asked to, but
+// reporting dangling links as links
+static walk_type_t stat_type(int dir_fd, const char *name, bool follow_links) {
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, follow_links ? 0 : AT_SYMLINK_NOFOLLOW) == 0) {
+        return mode_to_type(st.st_mode);
+    }
+    if (follow_links && fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        return mode_to_type(st.st_mode);
+    }
+    return WALK_UNKNOWN;
+}
+
+static walk_type_t entry_type(walker_t *walker, int dir_fd, struct dirent *entry) {
+    walk_type_t type = d_type_to_type(entry->d_type);
+    if (type == WALK_UNKNOWN || (type == WALK_SYMBOLIC_LINK && walker->follow_links)) {
+        type = stat_type(dir_fd, entry->d_name, walker->follow_links);
+    }
+    return type;
+}
+
+static void ensure_path_capacity(walker_t *walker, size_t capacity) {
+    if (capacity > walker->path_capacity) {
+        while (capacity > walker->path_capacity) {
+            walker->path_capacity *= 2;
+        }
+        walker->path = realloc(walker->path, walker->path_capacity);
+    }
+}
+
+static size_t dir_id_hash(dev_t dev, ino_t ino) {
+    uint64_t h = (uint64_t) ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t) dev;
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 29;
+    return (size_t) h;
+}
+
+// Adds the directory to the set, returning false if it was already there
+static bool dir_set_add(struct dir_set *set, dev_t dev, ino_t ino) {
+    if (2 * (set->size + 1) > set->capacity) {
+        size_t capacity = set->capacity ? 2 * set->capacity : 256;
+        struct dir_id *ids = calloc(capacity, sizeof(struct dir_id));
+        size_t i;
+        for (i = 0; i < set->capacity; i++) {
+            if (set->ids[i].used) {
+                size_t j = dir_id_hash(set->ids[i].dev, set->ids[i].ino) & (capacity - 1);
+                while (ids[j].used) {
+                    j = (j + 1) & (capacity - 1);
+                }
+                ids[j] = set->ids[i];
+            }
+        }
+        free(set->ids);
+        set->ids = ids;
+        set->capacity = capacity;
+    }
+
+    size_t i = dir_id_hash(dev, ino) & (set->capacity - 1);
+    while (set->ids[i].used) {
+        if (set->ids[i].dev == dev && set->ids[i].ino == ino) {
+            return false;
+        }
+        i = (i + 1) & (set->capacity - 1);
+    }
+    set->ids[i].dev = dev;
+    set->ids[i].ino = ino;
+    set->ids[i].used = true;
+    set->size++;
+    return true;
+}
+
+// Records the directory open as fd as walked, returning false if it already
+// was, whether a link led back to it from inside or from elsewhere
+static bool visit(struct dir_set *visited, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return false;
+    }
+    return dir_set_add(visited, st.st_dev, st.st_ino);
+}
+
+// Reads the entries of the directory open as dir, with their types
+static void read_entries(walker_t *walker, DIR *dir, struct walk_dir *walk_dir) {
+    size_t names_len = 0;
+    size_t names_capacity = 1024;
+    size_t entries_capacity = 32;
+    walk_dir->names = malloc(names_capacity);
+    walk_dir->entries = malloc(entries_capacity * sizeof(struct walk_entry));
+    walk_dir->num_entries = 0;
+    walk_dir->next = 0;
+
+    int dir_fd = dirfd(dir);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+
+        size_t name_len = strlen(name);
+        if (names_len + name_len + 1 > names_capacity) {
+            while (names_len + name_len + 1 > names_capacity) {
+                names_capacity *= 2;
+            }
+            walk_dir->names = realloc(walk_dir->names, names_capacity);
+        }
+        if (walk_dir->num_entries == entries_capacity) {
+            entries_capacity *= 2;
+            walk_dir->entries = realloc(walk_dir->entries, entries_capacity * sizeof(struct walk_entry));
+        }
+
+        memcpy(walk_dir->names + names_len, name, name_len + 1);
+        walk_dir->entries[walk_dir->num_entries].name = names_len;
+        walk_dir->entries[walk_dir->num_entries].type = entry_type(walker, dir_fd, entry);
+        walk_dir->num_entries++;
+        names_len += name_len + 1;
+    }
+}
+
+static void push_dir(walker_t *walker, int fd, size_t path_len, int depth) {
+    if (walker->follow_links && !visit(&walker->visited, fd)) {
+        close(fd);
+        return;
+    }
+
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return;
+    }
+
+    if (walker->stack_size == walker->stack_capacity) {
+        walker->stack_capacity *= 2;
+        walker->stack = realloc(walker->stack, walker->stack_capacity * sizeof(struct walk_dir));
+    }
+    struct walk_dir *walk_dir = &walker->stack[walker->stack_size++];
+    read_entries(walker, dir, walk_dir);
+    walk_dir->path_len = path_len;
+    walk_dir->depth = depth;
+    closedir(dir);
+}
+
+static void pop_dir(walker_t *walker) {
+    struct walk_dir *walk_dir = &walker->stack[--walker->stack_size];
+    free(walk_dir->names);
+    free(walk_dir->entries);
+}
+
+static bool should_descend(walker_t *walker, int depth) {
+    return walker->max_depth < 0 || depth < walker->max_depth;
+}
+
+static bool matches(walker_t *walker, const char *name) {
+    return walker->glob == NULL || fnmatch(walker->glob, name, 0) == 0;
+}
+
+walker_t *walk_open(const char *root, int max_depth, const char *glob, bool follow_links) {
+    walker_t *walker = calloc(1, sizeof(walker_t));
+    walker->root = strdup(root);
+    walker->max_depth = max_depth;
+    walker->glob = glob ? strdup(glob) : NULL;
+    walker->follow_links = follow_links;
+
+    walker->stack_capacity = 16;
+    walker->stack = malloc(walker->stack_capacity * sizeof(struct walk_dir));
+
+    walker->path_capacity = 256;
+    walker->path = malloc(walker->path_capacity);
+    return walker;
+}
+
+// Produces the root, and starts walking it if it is a directory
+static size_t walk_root(walker_t *walker, walk_fn_t fn, void *data) {
+    walk_type_t type = stat_type(AT_FDCWD, walker->root, walker->follow_links);
+
+    const char *name = strrchr(walker->root, '/');
+    name = name && name[1] ? name + 1 : walker->root;
+    size_t count = 0;
+    if (matches(walker, name)) {
+        fn(walker->root, type, data);
+        count++;
+    }
+
+    if (type == WALK_DIRECTORY && should_descend(walker, 0)) {
+        // Paths in the tree are formed by appending "/" and the name to the
+        // root, without any trailing slash it has
+        size_t root_len = strlen(walker->root);
+        if (root_len && walker->root[root_len - 1] == '/') {
+            root_len--;
+        }
+        ensure_path_capacity(walker, root_len + 1);
+        memcpy(walker->path, walker->root, root_len);
+
+        int fd = open(walker->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            push_dir(walker, fd, root_len, 0);
+        }
+    }
+
+    return count;
+}
+
+static size_t parallel_walk_next(walker_t *walker, size_t max, walk_fn_t fn, void *data);
+
+size_t walk_next(walker_t *walker, size_t max, walk_fn_t fn, void *data) {
+    if (walker->parallel) {
+        return parallel_walk_next(walker, max, fn, data);
+    }
+
+    size_t count = 0;
+    if (!walker->started) {
+        walker->started = true;
+        count += walk_root(walker, fn, data);
+    }
+
+    while (count < max && walker->stack_size > 0) {
+        struct walk_dir *top = &walker->stack[walker->stack_size - 1];
+        if (top->next == top->num_entries) {
+            pop_dir(walker);
+            continue;
+        }
+
+        struct walk_entry *entry = &top->entries[top->next++];
+        const char *name = top->names + entry->name;
+        walk_type_t type = entry->type;
+
+        size_t name_len = strlen(name);
+        size_t path_len = top->path_len + 1 + name_len;
+        ensure_path_capacity(walker, path_len + 1);
+        walker->path[top->path_len] = '/';
+        memcpy(walker->path + top->path_len + 1, name, name_len + 1);
+
+        if (matches(walker, name)) {
+            fn(walker->path, type, data);
+            count++;
+        }
+
+        int depth = top->depth + 1;
+        if (type == WALK_DIRECTORY && should_descend(walker, depth)) {
+            int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (walker->follow_links ? 0 : O_NOFOLLOW);
+            // Directories that can't be opened are produced but not walked
+            int fd = open(walker->path, flags);
+            if (fd >= 0) {
+                push_dir(walker, fd, path_len, depth);
+            }
+        }
+    }
+
+    return count;
+}
+
+static void parallel_walk_close(walker_t *walker);
+
+void walk_close(walker_t *walker) {
+    if (walker->parallel) {
+        parallel_walk_close(walker);
+    }
+    while (walker->stack_size > 0) {
+        pop_dir(walker);
+    }
+    free(walker->stack);
+    free(walker->path);
+    free(walker->visited.ids);
+    free(walker->root);
+    free(walker->glob);
+    free(walker);
+}
+
+// Parallel walks. Each worker thread owns a deque of directories to read,
+// pushing the subdirectories it finds onto the back of its own deque and
+// popping from the back, so that it works depth-first, and stealing from the
+// front of the others' deques when its own is empty. Entries are passed to
+// the consuming thread in a bounded queue, which workers block on when full.
+
+#define WALK_MAX_THREADS 64
+#define WALK_QUEUE_CAPACITY 8192
+
+struct walk_job {
+    char *path;
+    // The length of the path that entries in the directory are appended to,
+    // which only differs from that of the path for the root
+    size_t prefix_len;
+    int depth;
+};
+
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_job *jobs;
+    size_t head;
+    size_t size;
+    size_t capacity;
+};
+
+struct walk_result {
+    char *path;
+    walk_type_t type;
+};
+
+struct walk_worker {
+    walker_t *walker;
+    int index;
+    pthread_t thread;
+};
+
+struct parallel_walk {
+    int num_threads;
+    int num_started;
+    struct walk_worker *workers;
+    struct walk_deque *deques;
+    bool sorted;
+
+    // Guards the counts, flags and results below
+    pthread_mutex_t lock;
+    // Signalled when jobs are queued, or the walk is done or cancelled
+    pthread_cond_t work_cond;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    // Jobs in the deques (which can briefly be negative, as jobs are pushed
+    // before being counted), and jobs either in the deques or being read
+    long queued;
+    size_t pending;
+    bool done;
+    bool cancelled;
+    struct walk_result *results;
+    size_t results_head;
+    size_t results_size;
+
+    // Guards walker->visited
+    pthread_mutex_t visited_lock;
+
+    // All of the results, once sorted
+    struct walk_result *sorted_results;
+    size_t sorted_count;
+    size_t sorted_pos;
+};
+
+static void deque_push(struct walk_deque *deque, struct walk_job *job) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->size == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+        struct walk_job *jobs = malloc(capacity * sizeof(struct walk_job));
+        size_t i;
+        for (i = 0; i < deque->size; i++) {
+            jobs[i] = deque->jobs[(deque->head + i) % deque->capacity];
+        }
+        free(deque->jobs);
+        deque->jobs = jobs;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+    deque->jobs[(deque->head + deque->size) % deque->capacity] = *job;
+    deque->size++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static bool deque_pop_back(struct walk_deque *deque, struct walk_job *job) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->size > 0;
+    if (found) {
+        deque->size--;
+        *job = deque->jobs[(deque->head + deque->size) % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool deque_steal_front(struct walk_deque *deque, struct walk_job *job) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->size > 0;
+    if (found) {
+        *job = deque->jobs[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->size--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool take_job(struct parallel_walk *parallel, int index, struct walk_job *job) {
+    bool found = deque_pop_back(&parallel->deques[index], job);
+    int i;
+    for (i = 1; i < parallel->num_threads && !found; i++) {
+        found = deque_steal_front(&parallel->deques[(index + i) % parallel->num_threads], job);
+    }
+    if (found) {
+        pthread_mutex_lock(&parallel->lock);
+        parallel->queued--;
+        pthread_mutex_unlock(&parallel->lock);
+    }
+    return found;
+}
+
+// Pushes jobs onto the deque of worker index, counting them as pending
+// before any can be taken, so that the walk can't appear to be done
+static void push_jobs(struct parallel_walk *parallel, int index, struct walk_job *jobs, size_t count) {
+    if (count == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&parallel->lock);
+    parallel->pending += count;
+    pthread_mutex_unlock(&parallel->lock);
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        deque_push(&parallel->deques[index], &jobs[i]);
+    }
+
+    pthread_mutex_lock(&parallel->lock);
+    parallel->queued += count;
+    pthread_cond_broadcast(&parallel->work_cond);
+    pthread_mutex_unlock(&parallel->lock);
+}
+
+// Queues results for the consumer, returning false if the walk has been
+// cancelled, in which case they are discarded
+static bool deliver_results(struct parallel_walk *parallel, struct walk_result *results, size_t count) {
+    pthread_mutex_lock(&parallel->lock);
+    size_t i;
+    for (i = 0; i < count; i++) {
+        while (parallel->results_size == WALK_QUEUE_CAPACITY && !parallel->cancelled) {
+            pthread_cond_wait(&parallel->not_full, &parallel->lock);
+        }
+        if (parallel->cancelled) {
+            free(results[i].path);
+            continue;
+        }
+        parallel->results[(parallel->results_head + parallel->results_size) % WALK_QUEUE_CAPACITY] = results[i];
+        parallel->results_size++;
+    }
+    bool cancelled = parallel->cancelled;
+    pthread_cond_signal(&parallel->not_empty);
+    pthread_mutex_unlock(&parallel->lock);
+    return !cancelled;
+}
+
+static void read_dir_job(walker_t *walker, int index, struct walk_job *job) {
+    struct parallel_walk *parallel = walker->parallel;
+
+    int fd = open(job->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (walker->follow_links) {
+        pthread_mutex_lock(&parallel->visited_lock);
+        bool first_visit = visit(&walker->visited, fd);
+        pthread_mutex_unlock(&parallel->visited_lock);
+        if (!first_visit) {
+            close(fd);
+            return;
+        }
+    }
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return;
+    }
+
+    // The directory is read in full and closed before its entries are
+    // delivered, so that no descriptor is held while waiting for the consumer
+    struct walk_result *results = NULL;
+    size_t num_results = 0;
+    size_t results_capacity = 0;
+    struct walk_job *subdirs = NULL;
+    size_t num_subdirs = 0;
+    size_t subdirs_capacity = 0;
+
+    size_t path_capacity = job->prefix_len + 256;
+    char *path = malloc(path_capacity);
+    memcpy(path, job->path, job->prefix_len);
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+
+        size_t name_len = strlen(name);
+        size_t path_len = job->prefix_len + 1 + name_len;
+        if (path_len + 1 > path_capacity) {
+            path_capacity = 2 * (path_len + 1);
+            path = realloc(path, path_capacity);
+        }
+        path[job->prefix_len] = '/';
+        memcpy(path + job->prefix_len + 1, name, name_len + 1);
+
+        walk_type_t type = entry_type(walker, fd, entry);
+
+        if (matches(walker, name)) {
+            if (num_results == results_capacity) {
+                results_capacity = results_capacity ? results_capacity * 2 : 64;
+                results = realloc(results, results_capacity * sizeof(struct walk_result));
+            }
+            results[num_results].path = strdup(path);
+            results[num_results].type = type;
+            num_results++;
+        }
+
+        if (type == WALK_DIRECTORY && should_descend(walker, job->depth + 1)) {
+            if (num_subdirs == subdirs_capacity) {
+                subdirs_capacity = subdirs_capacity ? subdirs_capacity * 2 : 16;
+                subdirs = realloc(subdirs, subdirs_capacity * sizeof(struct walk_job));
+            }
+            subdirs[num_subdirs].path = strdup(path);
+            subdirs[num_subdirs].prefix_len = path_len;
+            subdirs[num_subdirs].depth = job->depth + 1;
+            num_subdirs++;
+        }
+    }
+    closedir(dir);
+    free(path);
+
+    bool delivered = deliver_results(parallel, results, num_results);
+    free(results);
+    if (!delivered) {
+        // Stop here, rather than queueing subdirectories nobody will read
+        size_t i;
+        for (i = 0; i < num_subdirs; i++) {
+            free(subdirs[i].path);
+        }
+        free(subdirs);
+        return;
+    }
+
+    // Push in reverse, so that popping from the back reads them in order
+    size_t i;
+    for (i = 0; i < num_subdirs / 2; i++) {
+        struct walk_job tmp = subdirs[i];
+        subdirs[i] = subdirs[num_subdirs - 1 - i];
+        subdirs[num_subdirs - 1 - i] = tmp;
+    }
+    push_jobs(parallel, index, subdirs, num_subdirs);
+    free(subdirs);
+}
+
+static void *walk_worker(void *arg) {
+    struct walk_worker *worker = arg;
+    struct parallel_walk *parallel = worker->walker->parallel;
+
+    for (;;) {
+        struct walk_job job;
+        if (take_job(parallel, worker->index, &job)) {
+            read_dir_job(worker->walker, worker->index, &job);
+            free(job.path);
+
+            pthread_mutex_lock(&parallel->lock);
+            if (--parallel->pending == 0) {
+                parallel->done = true;
+                pthread_cond_broadcast(&parallel->work_cond);
+                pthread_cond_signal(&parallel->not_empty);
+            }
+            bool cancelled = parallel->cancelled;
+            pthread_mutex_unlock(&parallel->lock);
+            if (cancelled) {
+                break;
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&parallel->lock);
+        while (parallel->queued <= 0 && !parallel->done && !parallel->cancelled) {
+            pthread_cond_wait(&parallel->work_cond, &parallel->lock);
+        }
+        bool finished = parallel->done || parallel->cancelled;
+        pthread_mutex_unlock(&parallel->lock);
+        if (finished) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void free_parallel_walk(struct parallel_walk *parallel) {
+    int i;
+    for (i = 0; i < parallel->num_threads; i++) {
+        struct walk_deque *deque = &parallel->deques[i];
+        size_t j;
+        for (j = 0; j < deque->size; j++) {
+            free(deque->jobs[(deque->head + j) % deque->capacity].path);
+        }
+        free(deque->jobs);
+        pthread_mutex_destroy(&deque->lock);
+    }
+    size_t j;
+    for (j = 0; j < parallel->results_size; j++) {
+        free(parallel->results[(parallel->results_head + j) % WALK_QUEUE_CAPACITY].path);
+    }
+    for (j = parallel->sorted_pos; j < parallel->sorted_count; j++) {
+        free(parallel->sorted_results[j].path);
+    }
+
+    pthread_mutex_destroy(&parallel->lock);
+    pthread_cond_destroy(&parallel->work_cond);
+    pthread_cond_destroy(&parallel->not_empty);
+    pthread_cond_destroy(&parallel->not_full);
+    pthread_mutex_destroy(&parallel->visited_lock);
+
+    free(parallel->workers);
+    free(parallel->deques);
+    free(parallel->results);
+    free(parallel->sorted_results);
+    free(parallel);
+}
+
+walker_t *walk_open_parallel(const char *root, int max_depth, const char *glob, bool follow_links,
+                             int num_threads, bool sorted) {
+    walker_t *walker = walk_open(root, max_depth, glob, follow_links);
+
+    if (num_threads <= 0) {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = num_cpus > 0 ? (int) num_cpus : 1;
+    }
+    if (num_threads > WALK_MAX_THREADS) {
+        num_threads = WALK_MAX_THREADS;
+    }
+
+    struct parallel_walk *parallel = calloc(1, sizeof(struct parallel_walk));
+    parallel->num_threads = num_threads;
+    parallel->workers = calloc((size_t) num_threads, sizeof(struct walk_worker));
+    parallel->deques = calloc((size_t) num_threads, sizeof(struct walk_deque));
+    parallel->sorted = sorted;
+    parallel->results = malloc(WALK_QUEUE_CAPACITY * sizeof(struct walk_result));
+    pthread_mutex_init(&parallel->lock, NULL);
+    pthread_cond_init(&parallel->work_cond, NULL);
+    pthread_cond_init(&parallel->not_empty, NULL);
+    pthread_cond_init(&parallel->not_full, NULL);
+    pthread_mutex_init(&parallel->visited_lock, NULL);
+    int i;
+    for (i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&parallel->deques[i].lock, NULL);
+    }
+    walker->parallel = parallel;
+
+    // The root comes first, followed by the entries found by the workers
+    walk_type_t type = stat_type(AT_FDCWD, walker->root, follow_links);
+    const char *name = strrchr(walker->root, '/');
+    name = name && name[1] ? name + 1 : walker->root;
+    if (matches(walker, name)) {
+        parallel->results[0].path = strdup(walker->root);
+        parallel->results[0].type = type;
+        parallel->results_size = 1;
+    }
+
+    if (type == WALK_DIRECTORY && should_descend(walker, 0)) {
+        struct walk_job job;
+        job.path = strdup(walker->root);
+        job.prefix_len = strlen(job.path);
+        if (job.prefix_len && job.path[job.prefix_len - 1] == '/') {
+            job.prefix_len--;
+        }
+        job.depth = 0;
+        push_jobs(parallel, 0, &job, 1);
+    } else {
+        parallel->done = true;
+        return walker;
+    }
+
+    // Make do with however many workers can be started, as the deques of
+    // any that can't be simply stay empty
+    for (i = 0; i < num_threads; i++) {
+        parallel->workers[i].walker = walker;
+        parallel->workers[i].index = i;
+        if (pthread_create(&parallel->workers[i].thread, NULL, walk_worker, &parallel->workers[i]) != 0) {
+            break;
+        }
+        parallel->num_started++;
+    }
+
+    if (parallel->num_started == 0) {
+        // Walk on the calling thread instead
+        walker->parallel = NULL;
+        free_parallel_walk(parallel);
+    }
+    return walker;
+}
+
+// Takes up to max results from the queue, waiting for at least one unless
+// the walk is done
+static size_t take_results(struct parallel_walk *parallel, size_t max, struct walk_result *results) {
+    pthread_mutex_lock(&parallel->lock);
+    while (parallel->results_size == 0 && !parallel->done) {
+        pthread_cond_wait(&parallel->not_empty, &parallel->lock);
+    }
+    size_t count = 0;
+    while (count < max && parallel->results_size > 0) {
+        results[count++] = parallel->results[parallel->results_head];
+        parallel->results_head = (parallel->results_head + 1) % WALK_QUEUE_CAPACITY;
+        parallel->results_size--;
+    }
+    if (count > 0) {
+        pthread_cond_broadcast(&parallel->not_full);
+    }
+    pthread_mutex_unlock(&parallel->lock);
+    return count;
+}
+
+// Orders paths as a pre-order walk visiting entries in name order would, by
+// treating separators as lower than any other character
+static int compare_results(const void *a, const void *b) {
+    const unsigned char *p = (const unsigned char *) ((const struct walk_result *) a)->path;
+    const unsigned char *q = (const unsigned char *) ((const struct walk_result *) b)->path;
+    while (*p && *p == *q) {
+        p++;
+        q++;
+    }
+    int c = *p == '/' ? 1 : *p;
+    int d = *q == '/' ? 1 : *q;
+    return c - d;
+}
+
+static void sort_results(struct parallel_walk *parallel) {
+    size_t capacity = 2 * WALK_QUEUE_CAPACITY;
+    parallel->sorted_results = malloc(capacity * sizeof(struct walk_result));
+    size_t n;
+    do {
+        if (parallel->sorted_count + WALK_QUEUE_CAPACITY > capacity) {
+            capacity *= 2;
+            parallel->sorted_results = realloc(parallel->sorted_results, capacity * sizeof(struct walk_result));
+        }
+        n = take_results(parallel, WALK_QUEUE_CAPACITY, parallel->sorted_results + parallel->sorted_count);
+        parallel->sorted_count += n;
+    } while (n > 0);
+    qsort(parallel->sorted_results, parallel->sorted_count, sizeof(struct walk_result), compare_results);
+}
+
+static size_t parallel_walk_next(walker_t *walker, size_t max, walk_fn_t fn, void *data) {
+    struct parallel_walk *parallel = walker->parallel;
+
+    struct walk_result *results;
+    size_t count;
+    if (parallel->sorted) {
+        if (parallel->sorted_results == NULL) {
+            sort_results(parallel);
+        }
+        results = parallel->sorted_results + parallel->sorted_pos;
+        count = parallel->sorted_count - parallel->sorted_pos < max ? parallel->sorted_count - parallel->sorted_pos : max;
+        parallel->sorted_pos += count;
+    } else {
+        results = malloc(max * sizeof(struct walk_result));
+        count = take_results(parallel, max, results);
+    }
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        fn(results[i].path, results[i].type, data);
+        free(results[i].path);
+    }
+
+    if (!parallel->sorted) {
+        free(results);
+    }
+    return count;
+}
+
+static void parallel_walk_close(walker_t *walker) {
+    struct parallel_walk *parallel = walker->parallel;
+
+    pthread_mutex_lock(&parallel->lock);
+    parallel->cancelled = true;
+    pthread_cond_broadcast(&parallel->work_cond);
+    pthread_cond_broadcast(&parallel->not_full);
+    pthread_mutex_unlock(&parallel->lock);
+
+    int i;
+    for (i = 0; i < parallel->num_started; i++) {
+        pthread_join(parallel->workers[i].thread, NULL);
+    }
+
+    walker->parallel = NULL;
+    free_parallel_walk(parallel);
+}
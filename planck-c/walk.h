@@ -0,0 +1,53 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+// A depth-first, pre-order walk of a directory tree. Each directory is read
+// in full and closed when the walk reaches it, so that a walk holds no
+// descriptors between calls, and the type of each entry is taken from
+// readdir where the filesystem provides it, so that entries are only stat'ed
+// when that isn't enough.
+
+typedef enum {
+    WALK_UNKNOWN,
+    WALK_FILE,
+    WALK_DIRECTORY,
+    WALK_SYMBOLIC_LINK,
+    WALK_SOCKET,
+    WALK_FIFO,
+    WALK_CHARACTER_SPECIAL,
+    WALK_BLOCK_SPECIAL
+} walk_type_t;
+
+#define WALK_NUM_TYPES (WALK_BLOCK_SPECIAL + 1)
+
+// The name of type, as used for the :type of planck.io/file-attributes
+const char *walk_type_name(walk_type_t type);
+
+typedef struct walker walker_t;
+
+// Called for each entry produced, with a path that is only valid during the
+// call
+typedef void (*walk_fn_t)(const char *path, walk_type_t type, void *data);
+
+// Starts a walk of the tree at root, which is the first entry produced.
+// Directories at max_depth (unless it is negative) are not descended into.
+// Only entries whose names match glob (unless it is NULL) are produced,
+// though all directories are descended into. With follow_links, symbolic
+// links are reported, and walked, as what they point to, except that each
+// directory is walked only once, however many links lead to it, so that
+// links back to a directory being walked don't lead round in circles.
+walker_t *walk_open(const char *root, int max_depth, const char *glob, bool follow_links);
+
+// Starts a walk as walk_open does, but reading directories on num_threads
+// worker threads (or one per CPU if it isn't positive), which produce
+// entries in no particular order. If sorted, all of the
+// entries are gathered before the first is produced, and produced in the
+// order of a walk that visits the entries of each directory in name order.
+walker_t *walk_open_parallel(const char *root, int max_depth, const char *glob, bool follow_links,
+                             int num_threads, bool sorted);
+
+// Produces up to max entries, calling fn for each, and returns how many were
+// produced. Returns 0 once the walk is done.
+size_t walk_next(walker_t *walker, size_t max, walk_fn_t fn, void *data);
+
+void walk_close(walker_t *walker);
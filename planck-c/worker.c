@@ -0,0 +1,293 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <JavaScriptCore/JavaScript.h>
+
+#include "bundle.h"
+#include "engine.h"
+#include "functions.h"
+#include "globals.h"
+#include "io.h"
+#include "jsc_utils.h"
+#include "str.h"
+#include "worker.h"
+
+// Each worker's context is created in a context group of its own: contexts
+// in the same group share a virtual machine and its lock, and so could not
+// run at the same time.
+
+struct message {
+    char *contents;
+    struct message *next;
+};
+
+struct worker {
+    char *fn_source;
+    char **requires;
+    size_t num_requires;
+    worker_reply_fn_t reply_fn;
+    void *data;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct message *head;
+    struct message *tail;
+    bool stopping;
+};
+
+// Returns the text of a bundled script (or one in the output directory, when
+// running from one), which the caller must free
+static char *load_script(const char *path) {
+    if (config.out_path != NULL) {
+        char *full_path = str_concat(config.out_path, path);
+        char *script = get_contents(full_path, NULL);
+        free(full_path);
+        return script;
+    }
+    const char *view = bundle_get_view(path, NULL);
+    return view ? strdup(view) : bundle_get_contents((char *) path);
+}
+
+char *worker_evaluate(JSContextRef context, const char *script, const char *source) {
+    JSStringRef script_ref = JSStringCreateWithUTF8CString(script);
+    JSStringRef source_ref = JSStringCreateWithUTF8CString(source);
+    JSValueRef ex = NULL;
+    JSEvaluateScript(context, script_ref, NULL, source_ref, 0, &ex);
+    JSStringRelease(script_ref);
+    JSStringRelease(source_ref);
+
+    if (ex == NULL) {
+        return NULL;
+    }
+    JSStringRef str = to_string(context, ex);
+    char *error = value_to_c_string(context, JSValueMakeString(context, str));
+    JSStringRelease(str);
+    return error;
+}
+
+static JSValueRef worker_import_script(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                       size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+        char *path = value_to_c_string(ctx, args[0]);
+        const char *relative_path = str_has_prefix(path, "goog/../") == 0 ? path + 8 : path;
+        char *script = load_script(relative_path);
+        if (script != NULL) {
+            JSStringRef script_ref = JSStringCreateWithUTF8CString(script);
+            JSStringRef source_ref = JSStringCreateWithUTF8CString(relative_path);
+            JSEvaluateScript(ctx, script_ref, NULL, source_ref, 0, exception);
+            JSStringRelease(script_ref);
+            JSStringRelease(source_ref);
+            free(script);
+        }
+        free(path);
+    }
+    return JSValueMakeUndefined(ctx);
+}
+
+char *worker_bootstrap(JSContextRef context) {
+    evaluate_script(context, "var global = this; var window = global;", "<worker>");
+    register_global_function(context, "AMBLY_IMPORT_SCRIPT", worker_import_script);
+    evaluate_script(context,
+                    "CLOSURE_IMPORT_SCRIPT = function(src) { AMBLY_IMPORT_SCRIPT('goog/' + src); return true; }",
+                    "<worker>");
+
+    const char *paths[] = {"goog/base.js", "main.js"};
+    size_t i;
+    for (i = 0; i < 2; i++) {
+        char *script = load_script(paths[i]);
+        if (script == NULL) {
+            return str_concat("Could not load ", paths[i]);
+        }
+        char *error = worker_evaluate(context, script, paths[i]);
+        free(script);
+        if (error) {
+            return error;
+        }
+    }
+
+    return worker_evaluate(context, "goog.require('cljs.core'); goog.require('cljs.reader');", "<worker>");
+}
+
+// Loads ClojureScript, the required namespaces and the worker's function,
+// returning a description of what went wrong, if anything
+static char *bootstrap_worker(JSContextRef context, worker_t *worker) {
+    char *error = worker_bootstrap(context);
+    size_t i;
+    for (i = 0; !error && i < worker->num_requires; i++) {
+        char *script = malloc(strlen(worker->requires[i]) + 32);
+        sprintf(script, "goog.require('%s');", worker->requires[i]);
+        error = worker_evaluate(context, script, "<worker>");
+        free(script);
+    }
+    if (error) {
+        return error;
+    }
+
+    register_global_function(context, "PLANCK_RAW_WRITE_STDOUT", function_raw_write_stdout);
+    register_global_function(context, "PLANCK_RAW_FLUSH_STDOUT", function_raw_flush_stdout);
+    register_global_function(context, "PLANCK_RAW_WRITE_STDERR", function_raw_write_stderr);
+    register_global_function(context, "PLANCK_RAW_FLUSH_STDERR", function_raw_flush_stderr);
+    register_global_function(context, "PLANCK_HIGH_RES_TIMER", function_high_res_timer);
+
+    error = worker_evaluate(context,
+                     "cljs.core.system_time = PLANCK_HIGH_RES_TIMER;"
+                     "cljs.core.set_print_fn_BANG_(PLANCK_RAW_WRITE_STDOUT);"
+                     "cljs.core.set_print_err_fn_BANG_(PLANCK_RAW_WRITE_STDERR);"
+                     "var PLANCK_WORKER_RECEIVE = function(message) {"
+                     "  var rv = PLANCK_WORKER_FN(cljs.reader.read_string(message));"
+                     "  return rv == null ? null : cljs.core.pr_str(rv);"
+                     "};",
+                     "<worker>");
+    if (error) {
+        return error;
+    }
+
+    char *script = malloc(strlen(worker->fn_source) + 32);
+    sprintf(script, "var PLANCK_WORKER_FN = (%s);", worker->fn_source);
+    error = worker_evaluate(context, script, "<worker:fn>");
+    free(script);
+    return error;
+}
+
+// Returns the next message, or NULL once the worker is stopping and has no
+// more
+static char *take_message(worker_t *worker) {
+    pthread_mutex_lock(&worker->lock);
+    while (worker->head == NULL && !worker->stopping) {
+        pthread_cond_wait(&worker->cond, &worker->lock);
+    }
+    char *contents = NULL;
+    struct message *message = worker->head;
+    if (message) {
+        worker->head = message->next;
+        if (worker->head == NULL) {
+            worker->tail = NULL;
+        }
+        contents = message->contents;
+        free(message);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return contents;
+}
+
+static void handle_message(JSContextRef context, JSObjectRef receive_fn, char *message, worker_t *worker) {
+    JSValueRef args[1];
+    args[0] = c_string_to_value(context, message);
+    JSValueRef ex = NULL;
+    JSValueRef rv = JSObjectCallAsFunction(context, receive_fn, NULL, 1, args, &ex);
+
+    if (ex) {
+        JSStringRef str = to_string(context, ex);
+        char *error = value_to_c_string(context, JSValueMakeString(context, str));
+        JSStringRelease(str);
+        worker->reply_fn(error, true, worker->data);
+    } else if (!JSValueIsNull(context, rv)) {
+        worker->reply_fn(value_to_c_string(context, rv), false, worker->data);
+    }
+}
+
+static void free_worker(worker_t *worker) {
+    size_t i;
+    for (i = 0; i < worker->num_requires; i++) {
+        free(worker->requires[i]);
+    }
+    free(worker->requires);
+    free(worker->fn_source);
+    pthread_mutex_destroy(&worker->lock);
+    pthread_cond_destroy(&worker->cond);
+    free(worker);
+}
+
+static void *run_worker(void *arg) {
+    worker_t *worker = arg;
+
+    JSGlobalContextRef context = JSGlobalContextCreate(NULL);
+    JSObjectRef receive_fn = NULL;
+    char *error = bootstrap_worker(context, worker);
+    if (error) {
+        worker->reply_fn(str_concat("Could not start worker: ", error), true, worker->data);
+        free(error);
+    } else {
+        JSStringRef name = JSStringCreateWithUTF8CString("PLANCK_WORKER_RECEIVE");
+        receive_fn = JSValueToObject(context,
+                                     JSObjectGetProperty(context, JSContextGetGlobalObject(context), name, NULL),
+                                     NULL);
+        JSStringRelease(name);
+    }
+
+    char *message;
+    while ((message = take_message(worker)) != NULL) {
+        // Messages to a worker that failed to start are dropped
+        if (receive_fn) {
+            handle_message(context, receive_fn, message, worker);
+        }
+        free(message);
+    }
+
+    JSGlobalContextRelease(context);
+
+    worker->reply_fn(NULL, false, worker->data);
+    free_worker(worker);
+    return NULL;
+}
+
+worker_t *worker_start(const char *fn_source, char **requires, size_t num_requires,
+                       worker_reply_fn_t reply_fn, void *data) {
+    worker_t *worker = calloc(1, sizeof(worker_t));
+    if (!worker) return NULL;
+
+    worker->fn_source = strdup(fn_source);
+    worker->requires = malloc(num_requires * sizeof(char *));
+    size_t i;
+    for (i = 0; i < num_requires; i++) {
+        worker->requires[i] = strdup(requires[i]);
+    }
+    worker->num_requires = num_requires;
+    worker->reply_fn = reply_fn;
+    worker->data = data;
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+
+    pthread_attr_t attr;
+    int err = pthread_attr_init(&attr);
+    if (!err) {
+        err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        if (!err) {
+            err = pthread_create(&thread, &attr, run_worker, worker);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    if (err) {
+        free_worker(worker);
+        errno = err;
+        return NULL;
+    }
+    return worker;
+}
+
+void worker_post(worker_t *worker, const char *message) {
+    struct message *m = malloc(sizeof(struct message));
+    m->contents = strdup(message);
+    m->next = NULL;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail) {
+        worker->tail->next = m;
+    } else {
+        worker->head = m;
+    }
+    worker->tail = m;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+void worker_stop(worker_t *worker) {
+    pthread_mutex_lock(&worker->lock);
+    worker->stopping = true;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
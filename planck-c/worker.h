@@ -0,0 +1,37 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <JavaScriptCore/JavaScript.h>
+
+// Workers evaluate a function in a JavaScript context of their own, with
+// ClojureScript bootstrapped from the bundle, on a thread of their own, so
+// that several can run at once. Messages to and replies from a worker are
+// strings, which planck.worker uses to carry EDN.
+
+typedef struct worker worker_t;
+
+// Called on the worker's thread with each reply (or, if error, a description
+// of an error), which the callee must free, and finally with NULL once the
+// worker has stopped.
+typedef void (*worker_reply_fn_t)(char *reply, bool error, void *data);
+
+// Starts a worker that loads the namespaces named in requires (munged), and
+// then calls the function defined by fn_source with each message posted to
+// it. Returns NULL, with errno set, if the worker could not be started.
+worker_t *worker_start(const char *fn_source, char **requires, size_t num_requires,
+                       worker_reply_fn_t reply_fn, void *data);
+
+// Queues a copy of message for the worker.
+void worker_post(worker_t *worker, const char *message);
+
+// Stops the worker once it has handled the messages already posted to it,
+// after which it frees itself, so it must not be used again.
+void worker_stop(worker_t *worker);
+
+// Loads ClojureScript into context, as is done for workers, returning a
+// description of what went wrong, if anything, which the caller must free.
+char *worker_bootstrap(JSContextRef context);
+
+// Evaluates script in context, returning a description of the exception it
+// threw, if any, which the caller must free.
+char *worker_evaluate(JSContextRef context, const char *script, const char *source);